@@ -0,0 +1,286 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <pthread.h>
+
+#include "bench.h"
+
+#define CHURN_OPS 4000000
+#define CHURN_SLOTS 10000
+#define ALIGNED_OPS 1000000
+#define REALLOC_ROUNDS 200
+#define REALLOC_MAX (1024 * 1024)
+#define CALLOC_ROUNDS 2000
+#define PC_THREADS 2 // producers, and as many consumers
+#define PC_OPS 1000000 // per producer
+#define PC_RING 1024
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15UL;
+
+static uint64_t rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+// size between 16 bytes and 8kb, small sizes are more frequent
+static size_t random_size(void)
+{
+	return 16 + (rng() % (1UL << (4 + rng() % 10)));
+}
+
+// malloc and free random slots of a pool, with fixed or random sizes
+static void run_churn(const char *name, void *arg)
+{
+	int random = arg != NULL;
+	void **slots = calloc(CHURN_SLOTS, sizeof(void *));
+	size_t *sizes = calloc(CHURN_SLOTS, sizeof(size_t));
+	size_t live = 0, peak_live = 0;
+	struct latency lat;
+
+	latency_init(&lat);
+	uint64_t start = now_ns();
+
+	for (unsigned long i = 0; i < CHURN_OPS; i++) {
+		size_t slot = rng() % CHURN_SLOTS;
+		uint64_t t0 = (i % LATENCY_SAMPLE_RATE == 0) ? now_ns() : 0;
+
+		if (slots[slot]) {
+			bench_free(slots[slot]);
+			slots[slot] = NULL;
+			live -= sizes[slot];
+		} else {
+			sizes[slot] = random ? random_size() : 64;
+			slots[slot] = bench_malloc(sizes[slot]);
+			*(char *) slots[slot] = 1;
+			live += sizes[slot];
+		}
+		if (t0)
+			latency_add(&lat, now_ns() - t0);
+		if (live > peak_live)
+			peak_live = live;
+	}
+	uint64_t elapsed = now_ns() - start;
+
+	bench_report(name, CHURN_OPS, elapsed, &lat, peak_live);
+	for (size_t i = 0; i < CHURN_SLOTS; i++)
+		bench_free(slots[i]);
+	free(slots);
+	free(sizes);
+}
+
+// grow buffers in small steps up to 1mb, like a string builder
+static void run_realloc(const char *name, void *arg)
+{
+	unsigned long ops = 0;
+	struct latency lat;
+	void *keep[REALLOC_ROUNDS];
+
+	(void) arg;
+	latency_init(&lat);
+	uint64_t start = now_ns();
+
+	for (int round = 0; round < REALLOC_ROUNDS; round++) {
+		char *buf = NULL;
+
+		for (size_t size = 64; size <= REALLOC_MAX; size += size / 8, ops++) {
+			uint64_t t0 = (ops % LATENCY_SAMPLE_RATE == 0) ? now_ns() : 0;
+
+			buf = bench_realloc(buf, size);
+			buf[size - 1] = 1;
+			if (t0)
+				latency_add(&lat, now_ns() - t0);
+		}
+		// keep a small buffer between the rounds to interleave with the heap
+		keep[round] = bench_malloc(random_size());
+		bench_free(buf);
+	}
+	uint64_t elapsed = now_ns() - start;
+
+	bench_report(name, ops, elapsed, &lat, REALLOC_MAX);
+	for (int round = 0; round < REALLOC_ROUNDS; round++)
+		bench_free(keep[round]);
+}
+
+// small blocks of 1 to 64 bytes aligned to 32 bytes up to a page, freed at random like the churn
+static void run_aligned(const char *name, void *arg)
+{
+	void **slots = calloc(CHURN_SLOTS, sizeof(void *));
+	size_t *sizes = calloc(CHURN_SLOTS, sizeof(size_t));
+	size_t live = 0, peak_live = 0;
+	struct latency lat;
+
+	(void) arg;
+	latency_init(&lat);
+	uint64_t start = now_ns();
+
+	for (unsigned long i = 0; i < ALIGNED_OPS; i++) {
+		size_t slot = rng() % CHURN_SLOTS;
+		uint64_t t0 = (i % LATENCY_SAMPLE_RATE == 0) ? now_ns() : 0;
+
+		if (slots[slot]) {
+			bench_free(slots[slot]);
+			slots[slot] = NULL;
+			live -= sizes[slot];
+		} else {
+			size_t alignment = 32UL << (rng() % 8);
+
+			sizes[slot] = 1 + rng() % 64;
+			slots[slot] = bench_aligned_alloc(alignment, sizes[slot]);
+			if (slots[slot] == NULL || (uintptr_t) slots[slot] % alignment != 0) {
+				fprintf(stderr, "%s: %p is not aligned to %zu\n", name, slots[slot], alignment);
+				exit(1);
+			}
+			// the whole block is written, an overrun into the allocator metadata shows up on the next calls
+			memset(slots[slot], 1, sizes[slot]);
+			live += sizes[slot];
+		}
+		if (t0)
+			latency_add(&lat, now_ns() - t0);
+		if (live > peak_live)
+			peak_live = live;
+	}
+	uint64_t elapsed = now_ns() - start;
+
+	bench_report(name, ALIGNED_OPS, elapsed, &lat, peak_live);
+	for (size_t i = 0; i < CHURN_SLOTS; i++)
+		bench_free(slots[i]);
+	free(slots);
+	free(sizes);
+}
+
+// zeroed tables of 64kb to 8mb, touched and freed
+static void run_calloc(const char *name, void *arg)
+{
+	struct latency lat;
+	size_t peak_live = 0;
+
+	(void) arg;
+	latency_init(&lat);
+	uint64_t start = now_ns();
+
+	for (int i = 0; i < CALLOC_ROUNDS; i++) {
+		size_t count = (64 * 1024 / sizeof(long)) << (rng() % 8);
+		uint64_t t0 = now_ns();
+		long *table = bench_calloc(count, sizeof(long));
+
+		latency_add(&lat, now_ns() - t0);
+		for (size_t j = 0; j < count; j += 512)
+			table[j] += j;
+		bench_free(table);
+		if (count * sizeof(long) > peak_live)
+			peak_live = count * sizeof(long);
+	}
+	uint64_t elapsed = now_ns() - start;
+
+	bench_report(name, CALLOC_ROUNDS, elapsed, &lat, peak_live);
+}
+
+// blocks allocated by producer threads and freed by consumer threads
+struct ring {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	void *items[PC_RING];
+	size_t head, tail;
+	int done;
+};
+
+static struct ring ring = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+static struct latency pc_lat[2 * PC_THREADS];
+
+static void *producer(void *arg)
+{
+	struct latency *lat = arg;
+	uint64_t seed = (uint64_t) arg;
+
+	for (unsigned long i = 0; i < PC_OPS; i++) {
+		seed = seed * 6364136223846793005UL + 1;
+
+		uint64_t t0 = (i % LATENCY_SAMPLE_RATE == 0) ? now_ns() : 0;
+		void *ptr = bench_malloc(16 + (seed >> 33) % 1024);
+
+		if (t0)
+			latency_add(lat, now_ns() - t0);
+
+		pthread_mutex_lock(&ring.lock);
+		while (ring.head - ring.tail == PC_RING)
+			pthread_cond_wait(&ring.cond, &ring.lock);
+		ring.items[ring.head++ % PC_RING] = ptr;
+		pthread_cond_broadcast(&ring.cond);
+		pthread_mutex_unlock(&ring.lock);
+	}
+	return NULL;
+}
+
+static void *consumer(void *arg)
+{
+	struct latency *lat = arg;
+	unsigned long i = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&ring.lock);
+		while (ring.head == ring.tail && !ring.done)
+			pthread_cond_wait(&ring.cond, &ring.lock);
+		if (ring.head == ring.tail) {
+			pthread_mutex_unlock(&ring.lock);
+			return NULL;
+		}
+		void *ptr = ring.items[ring.tail++ % PC_RING];
+
+		pthread_cond_broadcast(&ring.cond);
+		pthread_mutex_unlock(&ring.lock);
+
+		uint64_t t0 = (i++ % LATENCY_SAMPLE_RATE == 0) ? now_ns() : 0;
+
+		bench_free(ptr);
+		if (t0)
+			latency_add(lat, now_ns() - t0);
+	}
+}
+
+static void run_producer_consumer(const char *name, void *arg)
+{
+	pthread_t threads[2 * PC_THREADS];
+	struct latency lat;
+
+	(void) arg;
+	latency_init(&lat);
+	for (int i = 0; i < 2 * PC_THREADS; i++)
+		latency_init(&pc_lat[i]);
+
+	uint64_t start = now_ns();
+
+	for (int i = 0; i < PC_THREADS; i++) {
+		pthread_create(&threads[i], NULL, producer, &pc_lat[i]);
+		pthread_create(&threads[PC_THREADS + i], NULL, consumer, &pc_lat[PC_THREADS + i]);
+	}
+	for (int i = 0; i < PC_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_lock(&ring.lock);
+	ring.done = 1;
+	pthread_cond_broadcast(&ring.cond);
+	pthread_mutex_unlock(&ring.lock);
+	for (int i = 0; i < PC_THREADS; i++)
+		pthread_join(threads[PC_THREADS + i], NULL);
+	uint64_t elapsed = now_ns() - start;
+
+	for (int i = 0; i < 2 * PC_THREADS; i++)
+		latency_merge(&lat, &pc_lat[i]);
+	bench_report(name, 2UL * PC_THREADS * PC_OPS, elapsed, &lat, PC_RING * 1040);
+}
+
+int main(int argc, char *argv[])
+{
+	int header = argc < 2 || strcmp(argv[1], "-n") != 0;
+
+	if (header)
+		bench_header();
+	bench_run("churn-fixed-64", run_churn, NULL);
+	bench_run("churn-random", run_churn, (void *) 1);
+	bench_run("realloc-growth", run_realloc, NULL);
+	bench_run("aligned-small", run_aligned, NULL);
+	bench_run("calloc-tables", run_calloc, NULL);
+	bench_run("producer-consumer", run_producer_consumer, NULL);
+	return 0;
+}
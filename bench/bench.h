@@ -0,0 +1,149 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The same sources are built against osmem and against the C library */
+#ifdef BENCH_GLIBC
+/* BENCH_ALLOCATOR names another allocator put under the C library build with LD_PRELOAD */
+#define BENCH_ALLOCATOR (getenv("BENCH_ALLOCATOR") ? getenv("BENCH_ALLOCATOR") : "glibc")
+#define bench_malloc malloc
+#define bench_free free
+#define bench_calloc calloc
+#define bench_realloc realloc
+#define bench_aligned_alloc aligned_alloc
+#else
+#include "osmem.h"
+#ifdef BENCH_DEBUG
+#define BENCH_ALLOCATOR "debug" /* against libosmem-debug.so */
+#else
+#define BENCH_ALLOCATOR "osmem"
+#endif
+#define bench_malloc os_malloc
+#define bench_free os_free
+#define bench_calloc os_calloc
+#define bench_realloc os_realloc
+#define bench_aligned_alloc os_aligned_alloc
+#endif
+
+/* Every LATENCY_SAMPLE_RATE-th operation is timed on its own */
+#define LATENCY_SAMPLE_RATE 16
+#define LATENCY_MAX_SAMPLES (1 << 20)
+
+struct latency {
+	uint32_t *samples;
+	size_t count;
+};
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The samples are mapped directly, so they don't disturb the allocator under test */
+static inline void latency_init(struct latency *lat)
+{
+	lat->samples = mmap(NULL, LATENCY_MAX_SAMPLES * sizeof(uint32_t), PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (lat->samples == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	lat->count = 0;
+}
+
+static inline void latency_add(struct latency *lat, uint64_t ns)
+{
+	if (lat->count < LATENCY_MAX_SAMPLES)
+		lat->samples[lat->count++] = (ns > UINT32_MAX) ? UINT32_MAX : ns;
+}
+
+/* Append the samples of src to dst */
+static inline void latency_merge(struct latency *dst, struct latency *src)
+{
+	for (size_t i = 0; i < src->count; i++)
+		latency_add(dst, src->samples[i]);
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+static inline uint32_t latency_percentile(struct latency *lat, double p)
+{
+	if (lat->count == 0)
+		return 0;
+	return lat->samples[(size_t)(p * (lat->count - 1))];
+}
+
+/* Peak resident set of the process in kilobytes */
+static inline long peak_rss_kb(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+/*
+ * Print one line of results: throughput, latency percentiles, peak RSS and
+ * the ratio of peak RSS to the peak of the bytes requested and still live
+ */
+static inline void bench_report(const char *name, unsigned long ops, uint64_t elapsed_ns,
+								struct latency *lat, size_t peak_live)
+{
+	double seconds = elapsed_ns / 1e9;
+	long rss = peak_rss_kb();
+
+	qsort(lat->samples, lat->count, sizeof(uint32_t), compare_samples);
+	printf("%-6s %-24s %12.0f %8u %8u %10ld %8.2f", BENCH_ALLOCATOR, name,
+		   seconds > 0 ? ops / seconds : 0.0, latency_percentile(lat, 0.5),
+		   latency_percentile(lat, 0.99), rss, peak_live ? rss * 1024.0 / peak_live : 0.0);
+#ifndef BENCH_GLIBC
+	struct os_malloc_stats stats;
+
+	os_malloc_stats(&stats);
+	printf(" %8.2f%%\n", stats.fragmentation * 100);
+#else
+	printf(" %9s\n", "-");
+#endif
+	fflush(stdout);
+}
+
+static inline void bench_header(void)
+{
+	printf("%-6s %-24s %12s %8s %8s %10s %8s %9s\n", "alloc", "benchmark", "ops/s",
+		   "p50(ns)", "p99(ns)", "rss(kb)", "rss/live", "frag");
+	fflush(stdout);
+}
+
+/* Run a benchmark in a child process, so every one starts from a fresh heap and RSS */
+static inline void bench_run(const char *name, void (*fn)(const char *name, void *arg), void *arg)
+{
+	pid_t pid = fork();
+
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0) {
+		fn(name, arg);
+		exit(0);
+	}
+	waitpid(pid, NULL, 0);
+}
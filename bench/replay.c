@@ -0,0 +1,129 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "bench.h"
+
+// a trace has one operation per line, ids name the live blocks:
+//   m <id> <size>            malloc
+//   c <id> <nmemb> <size>    calloc
+//   r <id> <size>            realloc
+//   f <id>                   free
+struct trace_op {
+	char kind;
+	unsigned long id;
+	size_t nmemb;
+	size_t size;
+};
+
+// the trace and the block table are mapped directly, like the latency samples
+static void *map_array(size_t count, size_t size)
+{
+	void *ptr = mmap(NULL, count * size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (ptr == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	return ptr;
+}
+
+static struct trace_op *load_trace(const char *path, size_t *count, unsigned long *max_id)
+{
+	FILE *file = fopen(path, "r");
+	char line[256];
+	size_t lines = 0;
+
+	if (file == NULL) {
+		perror(path);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), file))
+		lines++;
+	rewind(file);
+
+	struct trace_op *ops = map_array(lines, sizeof(struct trace_op));
+
+	*count = 0;
+	*max_id = 0;
+	while (fgets(line, sizeof(line), file)) {
+		struct trace_op *op = &ops[*count];
+		int fields = sscanf(line, " %c %lu %zu %zu", &op->kind, &op->id, &op->nmemb, &op->size);
+
+		if (fields < 2 || line[0] == '#')
+			continue;
+		if (op->kind == 'm' || op->kind == 'r')
+			op->size = op->nmemb;
+		if (op->id > *max_id)
+			*max_id = op->id;
+		(*count)++;
+	}
+	fclose(file);
+	return ops;
+}
+
+static void replay(const char *name, void *arg)
+{
+	size_t count;
+	unsigned long max_id;
+	struct trace_op *ops = load_trace(arg, &count, &max_id);
+	void **blocks = map_array(max_id + 1, sizeof(void *));
+	size_t *sizes = map_array(max_id + 1, sizeof(size_t));
+	size_t live = 0, peak_live = 0;
+	struct latency lat;
+
+	latency_init(&lat);
+	uint64_t start = now_ns();
+
+	for (size_t i = 0; i < count; i++) {
+		struct trace_op *op = &ops[i];
+		uint64_t t0 = (i % LATENCY_SAMPLE_RATE == 0) ? now_ns() : 0;
+
+		live -= sizes[op->id];
+		switch (op->kind) {
+		case 'm':
+			blocks[op->id] = bench_malloc(op->size);
+			sizes[op->id] = op->size;
+			break;
+		case 'c':
+			blocks[op->id] = bench_calloc(op->nmemb, op->size);
+			sizes[op->id] = op->nmemb * op->size;
+			break;
+		case 'r':
+			blocks[op->id] = bench_realloc(blocks[op->id], op->size);
+			sizes[op->id] = op->size;
+			break;
+		case 'f':
+			bench_free(blocks[op->id]);
+			blocks[op->id] = NULL;
+			sizes[op->id] = 0;
+			break;
+		}
+		if (t0)
+			latency_add(&lat, now_ns() - t0);
+		// touch the block like the traced program would
+		if (blocks[op->id] && sizes[op->id])
+			*(char *) blocks[op->id] = 1;
+		live += sizes[op->id];
+		if (live > peak_live)
+			peak_live = live;
+	}
+	uint64_t elapsed = now_ns() - start;
+
+	bench_report(name, count, elapsed, &lat, peak_live);
+}
+
+int main(int argc, char *argv[])
+{
+	int first = 1;
+
+	if (argc > 1 && strcmp(argv[1], "-n") == 0)
+		first = 2;
+	else
+		bench_header();
+
+	for (int i = first; i < argc; i++) {
+		const char *name = strrchr(argv[i], '/');
+
+		bench_run(name ? name + 1 : argv[i], replay, argv[i]);
+	}
+	return 0;
+}
@@ -3,12 +3,21 @@
 #pragma once
 
 #include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <linux/mempolicy.h>
 #include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
 #define DIE(assertion, call_description)						\
@@ -20,14 +29,52 @@
 		}														\
 	} while (0)
 
-/* Structure to hold memory block metadata */
+/* Header of every block, heap blocks follow each other so the next one is found from the size */
 struct block_meta {
-	size_t size;
-	int status;
-	struct block_meta *next;
+#ifdef OSMEM_DEBUG
+	unsigned long canary; /* derived from the address, an overflow of the previous block hits it first */
+	size_t requested; /* bytes asked for, the tail canary follows them */
+#endif
+	unsigned int magic;
+	unsigned int flags;
+	size_t size; /* payload size, the low bits hold the status and BLOCK_PREV_FREE */
 };
 
-/* Block metadata status values */
+/* Links in the segregated free lists, stored at the start of the payload of FREE heap blocks */
+struct free_links {
+	struct block_meta *prev_free;
+	struct block_meta *next_free;
+};
+
+/* Links of the FREE heap blocks of the large bins, each bin is a binary trie keyed by size with one node
+ * per size: the other blocks of that size follow the node in the list, with prev_free set */
+struct tree_links {
+	struct free_links list;
+	struct block_meta *child[2];
+	struct block_meta *parent; /* NULL at the root */
+};
+
+/* Boundary tag closing every FREE heap block, holds the size of the block */
+#define FOOTER_SIZE sizeof(size_t)
+
+/* Block metadata status values, in the low bits of the size */
 #define STATUS_FREE   0
 #define STATUS_ALLOC  1
 #define STATUS_MAPPED 2
+#define STATUS_MASK   0x3
+
+/* The physically previous heap block is FREE and ends with its footer */
+#define BLOCK_PREV_FREE 0x4
+#define SIZE_MASK (~(size_t) 0x7)
+
+/* Block metadata flags */
+#define BLOCK_ZEROED 0x1 /* the payload is known to be all zeros (fresh mmap or sbrk memory) */
+#define BLOCK_RELEASED 0x2 /* FREE block whose pages inside the payload are not resident */
+#define BLOCK_HUGETLB 0x4 /* mmap block mapped with MAP_HUGETLB, it can't be remapped */
+#define BLOCK_SAMPLED 0x8 /* allocation sampled by the heap profiler, the high bits hold its call site */
+#define BLOCK_RESIZED 0x10 /* mmap block resized with mremap, its length is not requested again */
+#define BLOCK_QUARANTINED 0x20 /* freed in a debug build, held back from reuse */
+#define BLOCK_GUARDED 0x40 /* mmap block followed by a guard page in a debug build, never remapped or cached */
+
+/* Marks a header written by the allocator, checked before trusting a pointer */
+#define BLOCK_MAGIC 0x6f736d65
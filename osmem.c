@@ -1,65 +1,394 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
+#define _GNU_SOURCE // mremap
+
 #include "osmem.h"
 #include "helpers.h"
 
-#define ALIGNMENT 8
+#define ALIGNMENT 16 // as the x86-64 ABI requires for long double and SSE types
 #define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~(ALIGNMENT-1))
 #define BLOCK_META_SIZE sizeof(struct block_meta)
+#define MIN_PAYLOAD (sizeof(struct free_links) + FOOTER_SIZE) // room for the links and footer once FREE
+#define MAPPED_HEADER_SIZE sizeof(struct mapped_block)
 #define PREALLOC_SIZE (128 * 1024) // 128kb
 #define ALLOCATION_FAILED ((void *) -1) // same as MAP_FAILED
+#define MAP_THRESHOLD (128 * 1024) // 128kb, initial mmap threshold
+#define MAP_THRESHOLD_MAX (32 * 1024 * 1024) // 32mb, fits in an arena chunk
+#define TRIM_THRESHOLD (128 * 1024) // 128kb, initial trim threshold
+#define HEAP_GROW_SIZE (128 * 1024) // 128kb, default heap growth step
+#define MAX_REQUEST_SIZE PTRDIFF_MAX // as in the C library, rounding a smaller request can't wrap
+
+// huge pages are opt-in with the OSMEM_THP environment variable:
+// - "madvise" (or "1") aligns large mappings and the heap to 2mb and asks for transparent huge pages
+// - "hugetlb" also maps large blocks from the reserved huge page pool, when it isn't empty
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+#define THP_OFF     0
+#define THP_MADVISE 1
+#define THP_HUGETLB 2
+
+// mmap blocks released by os_free stay mapped for the next requests of the same length,
+// at most mmap_cache_size bytes in MMAP_CACHE_ENTRIES mappings, each for MMAP_CACHE_TIMEOUT
+#define MMAP_CACHE_ENTRIES 32
+#define MMAP_CACHE_SIZE (64UL * 1024 * 1024) // 64mb, default size of the cache
+#define MMAP_CACHE_TIMEOUT 1000000000UL // 1s, in ns
+
+// free heap blocks are kept in segregated bins by size class:
+// - small bins hold exactly one size each (a multiple of ALIGNMENT below SMALL_BIN_LIMIT) in a list
+// - large bins split every power of two above it in BIN_SUBDIVISIONS ranges, each one a trie
+//   on the size bits below the ones selecting the bin, so best fit is found in O(log n)
+#define SMALL_BINS 64
+#define SMALL_BIN_LIMIT (SMALL_BINS * ALIGNMENT)
+#define BIN_SUBDIVISIONS_LOG 2
+#define NUM_BINS 128
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+#define BINMAP_WORDS (NUM_BINS / BITS_PER_LONG)
+
+// two level radix tree over the 48 bit address space with one entry per page,
+// used to recognise the first page of mmap blocks without walking the list
+#define PAGEMAP_SHIFT 12
+#define PAGEMAP_LEAF_BITS 18
+#define PAGEMAP_ROOT_BITS (48 - PAGEMAP_SHIFT - PAGEMAP_LEAF_BITS)
+#define PAGE_NONE   0
+#define PAGE_MAPPED 1
+#define PAGE_ARENA  2
+
+// arenas other than the main one grow with mmap chunks aligned to their size,
+// so the chunk (and the arena) of a block is found by masking its address
+#define MAX_ARENAS 64
+#define ARENAS_PER_CPU 2
+#define ARENA_CHUNK_SIZE (64UL * 1024 * 1024) // 64mb, reserved but only touched on use
+
+// in NUMA mode (OSMEM_NUMA=1) the other arenas are spread over the memory nodes,
+// arena i being bound to node (i - 1) % numa_count
+#define MAX_NUMA_NODES 8
+#define CHUNK_HEADER_SIZE ALIGN(sizeof(struct arena_chunk))
+
+// requests up to SLAB_MAX_SIZE are served by page sized slabs cut in equal slots,
+// without block headers: the size comes from the slab header at the start of the page
+#define PAGE_SLAB 3
+#define SLAB_SIZE 4096UL
+#define SLAB_MAX_SIZE 256
+#define SLAB_CLASSES 12
+#define SLAB_CLASS_STEP 16
+#define SLAB_MAP_WORDS (SLAB_SIZE / SLAB_CLASS_STEP / BITS_PER_LONG)
+#define SLAB_HEADER_SIZE ((sizeof(struct slab) + SLAB_CLASS_STEP - 1) & ~(SLAB_CLASS_STEP - 1))
+#define SLAB_SEGMENT_SIZE (64 * SLAB_SIZE) // slab pages are mapped 64 at a time
+// empty slab pages stay resident up to the trim threshold, the next ones are released with
+// MADV_DONTNEED and their addresses kept in one of them, turned into a struct slab_released
+#define SLAB_RELEASED_PER_PAGE (SLAB_SIZE / sizeof(void *) - 2)
+
+// per thread cache of recently freed heap blocks, one bin per TCACHE_BIN_STEP bytes
+#define TCACHE_BIN_STEP 16
+#define TCACHE_BINS 64
+#define TCACHE_MAX_SIZE (TCACHE_BINS * TCACHE_BIN_STEP)
+#define TCACHE_COUNT 7 // cached blocks per bin
+
+// a pointer freed by a thread outside of its arena is pushed on the remote list of the arena
+// without its lock, the list is taken back on the next allocation from the arena
+// the key marks the queued pointers, to catch a double free before it loops the list
+#define REMOTE_ENTRY_KEY 0x7f4a7c15e3779b97UL
+
+// regions carve their allocations out of chunks taken from the heap, larger
+// allocations get a chunk of their own
+#define REGION_CHUNK_SIZE (64 * 1024) // 64kb
+#define REGION_LARGE_SIZE (REGION_CHUNK_SIZE / 4)
+#define REGION_CHUNK_HEADER_SIZE ALIGN(sizeof(struct region_chunk))
+
+// os_free_batch sorts and frees this many pointers at a time, one lock per arena they belong to
+#define FREE_BATCH 64
+
+// the heap profiler is opt-in with OSMEM_PROFILE=<bytes>: one allocation is sampled every
+// that many bytes on average and the sampled bytes are kept by call stack
+#define PROFILE_SITES 4096
+#define PROFILE_DEPTH 32
+#define PROFILE_SKIP 2 // frames of profile_record and alloc_memory
+#define PROFILE_SITE_SHIFT 8 // of the site index in the flags of a sampled block
+
+// the debug build (make debug, -DOSMEM_DEBUG) checks every block it frees and reports an error with abort:
+// - the header starts with a canary derived from its address and the requested bytes are followed
+//   by DEBUG_TAIL_SIZE bytes of it, so an overflow or a stray write is caught on the next free
+// - freed heap blocks are poisoned and held in a per thread quarantine, the poison is checked and
+//   the canary inverted when they leave it, which catches the writes after free and the double frees
+// - small requests skip the slabs, so that every block has a header
+// - with OSMEM_GUARD=1 the payload of the mmap blocks ends right before a PROT_NONE page
+#ifdef OSMEM_DEBUG
+#define DEBUG_BUILD 1
+#define DEBUG_TAIL_SIZE (2 * sizeof(unsigned long))
+#define DEBUG_POISON 0xdf
+#define DEBUG_POISON_SIZE 1024 // poisoned bytes at the start of a freed block
+#define QUARANTINE_ENTRIES 256 // freed blocks held back by a thread
+#define QUARANTINE_SIZE (1024 * 1024) // 1mb, bytes held back by a thread
+#define QUARANTINE_MAX_BLOCK (QUARANTINE_SIZE / 8) // larger blocks aren't held
+#else
+#define DEBUG_BUILD 0
+#define DEBUG_TAIL_SIZE 0
+#endif
+
+// an independent heap with its own free lists and lock
+struct arena {
+	pthread_mutex_t lock;
+	struct block_meta *free_bins[NUM_BINS];
+	unsigned long bin_map[BINMAP_WORDS]; // bitmap of the non empty bins
+	size_t free_bytes; // in the free lists
+	struct arena_chunk *chunks;
+	struct slab *slabs[SLAB_CLASSES]; // slabs with free slots, by size class
+	struct slab *empty_slabs;
+	size_t empty_count; // resident pages in empty_slabs
+	struct slab_released *released_slabs; // pages of released slab addresses
+	char *slab_next, *slab_end; // pages of the last slab segment not handed out yet
+	struct tcache_entry *remote_frees; // pushed by the other threads with a CAS
+};
+
+// header at the start of every slab page, the slots follow it
+struct slab {
+	struct slab *prev, *next;
+	struct arena *arena;
+	unsigned int slot_size;
+	unsigned int total;
+	unsigned int free_count;
+	unsigned long free_map[SLAB_MAP_WORDS]; // a set bit for every free slot
+};
 
-size_t MAP_THRESHOLD = 128 * 1024;
+// empty slab page holding the addresses of released slab pages, it can itself become a slab again
+struct slab_released {
+	struct slab_released *next;
+	unsigned long count;
+	void *pages[SLAB_RELEASED_PER_PAGE];
+};
 
-// head of the memory list allocated
-static struct block_meta *head;
+// header at the start of every mmap chunk of an arena
+struct arena_chunk {
+	struct arena *arena;
+	struct arena_chunk *next;
+};
+
+// header of every mmap block, linked in the list of mapped blocks
+// it starts the mapping, except for aligned blocks which have it right before the payload
+struct mapped_block {
+	struct mapped_block *prev, *next;
+	size_t offset; // from the start of the mapping to the header
+	size_t length; // of the mapping
+	struct block_meta meta;
+};
+
+// mapping released by os_free and kept for reuse
+struct mmap_cache_entry {
+	struct mapped_block *map; // NULL for an unused entry
+	size_t length;
+	unsigned int flags; // BLOCK_HUGETLB of the mapping, it isn't zeroed anymore
+	unsigned long released; // time of the release, in ns
+};
+
+// freed pointer kept in a thread cache, the links live in the payload
+struct tcache_entry {
+	struct tcache_entry *next;
+	unsigned long key; // tcache_entry_key while cached, to catch double frees
+};
+
+// calls and usable bytes allocated and freed by a thread, only the thread writes them
+#define STAT_ALLOC 0
+#define STAT_FREE  1
+struct thread_stats {
+	size_t calls[2];
+	size_t bytes[2];
+};
+
+struct thread_cache {
+	struct tcache_entry *bins[TCACHE_BINS];
+	unsigned char counts[TCACHE_BINS];
+	struct arena *arena; // arena serving the heap allocations of the thread
+	void *remote[FREE_BATCH]; // freed pointers of arenas on another node, in NUMA mode
+	int remote_count;
+	struct thread_stats stats;
+	struct thread_cache *prev, *next; // in the list of threads
+	long sample_left; // bytes to allocate before the next sample
+	unsigned long sample_seed;
+	int sampling; // inside the profiler, its own allocations aren't sampled
+	int registered;
+	int disabled;
+#ifdef OSMEM_DEBUG
+	void *quarantine[QUARANTINE_ENTRIES]; // ring of freed pointers, the oldest at quarantine_head
+	int quarantine_head, quarantine_count;
+	size_t quarantine_bytes;
+#endif
+};
+
+// call stack of sampled allocations, with the sampled calls and bytes in use and in total
+struct profile_site {
+	void *stack[PROFILE_DEPTH];
+	int depth; // 0 for an unused entry
+	unsigned long hash;
+	size_t live_count, live_bytes;
+	size_t total_count, total_bytes;
+};
+
+// memory of a region, the allocations follow the header
+struct region_chunk {
+	struct region_chunk *next;
+	size_t size;
+};
+
+// allocations are pointer bumps in the current chunk, they are all dropped at once
+struct os_region {
+	struct region_chunk *chunks; // chunks in use, the current one first
+	struct region_chunk *last; // of the chunks in use
+	struct region_chunk *spare; // chunks kept by a reset for reuse
+	struct region_chunk *large; // chunks of a single large allocation
+	char *next, *end; // free space of the current chunk
+};
+
+// requests of at least mmap_threshold bytes (header included) are mapped with mmap
+// it starts at MAP_THRESHOLD and follows the size of the freed mmap blocks, up to MAP_THRESHOLD_MAX,
+// so buffers that keep being allocated and freed end up on the heap instead of cycling through mmap
+// a threshold set by the configuration stays fixed
+static size_t mmap_threshold = MAP_THRESHOLD;
+static int mmap_threshold_fixed;
+
+// FREE heap blocks of at least trim_threshold bytes give their pages back to the kernel:
+// the end of the sbrk heap with a negative sbrk, anything else with madvise
+// it follows the mmap threshold at twice its value, unless the configuration set it
+static size_t trim_threshold = TRIM_THRESHOLD;
+static int trim_threshold_fixed;
+
+// the sbrk heap grows by at least heap_grow_size bytes at a time, the rest of the step
+// stays FREE at the end of the heap for the next requests, and a trim keeps that much
+// the heap starts with prealloc_size bytes, both are guarded by the main arena lock
+static size_t heap_grow_size = HEAP_GROW_SIZE;
+static size_t prealloc_size = PREALLOC_SIZE;
+
+// runtime configuration, read from the OSMEM_* environment variables on the first allocation
+// and changed by os_mallopt afterwards
+static int configured;
+static pthread_once_t config_once = PTHREAD_ONCE_INIT;
+static int arena_limit; // arenas to spread the threads over, 0 for ARENAS_PER_CPU per CPU
+static size_t mmap_cache_size = MMAP_CACHE_SIZE;
+static int stats_at_exit_enabled;
+
+// huge page mode, read from the environment on first use
+static int thp_mode = -1;
+
+// mmap blocks handed out, the heap blocks are reached from their neighbours instead
+static struct mapped_block *mapped_blocks;
+static pthread_mutex_t mapped_lock = PTHREAD_MUTEX_INITIALIZER;
 static int heap_preallocated;
+// released mappings kept mapped, guarded by mapped_lock too
+static struct mmap_cache_entry mmap_cache[MMAP_CACHE_ENTRIES];
+static size_t mmap_cache_bytes;
+static unsigned long mmap_cache_expiry; // when the oldest cached mapping times out, 0 if none is cached
+
+// arena 0 is the main arena, it owns the sbrk heap
+// threads are spread round robin over the arenas, the common malloc/free pairs
+// never take an arena lock, they are served by the thread cache
+static struct arena arenas[MAX_ARENAS] = {
+	[0 ... MAX_ARENAS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+static struct arena *const main_arena = &arenas[0];
+static int narenas;
+static unsigned int next_arena;
+static int numa_count; // memory nodes in NUMA mode, 0 otherwise
+
+// small freed pointers of the current thread, they stay allocated for the backend
+static __thread struct thread_cache tcache;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static unsigned long tcache_entry_key;
+
+// statistics: the counters of the running threads are summed on demand, the ones
+// of the exited threads are kept in exited_stats, stats_lock guards the list
+// the rest is counted on the slow paths
+static struct thread_cache *threads;
+static struct thread_stats exited_stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t mapped_count, mapped_usable, mapped_reserved; // guarded by mapped_lock
+static unsigned long arena_chunks, slab_segments;
+
+// heap profiler: mean bytes between samples, 0 when off and -1 until read from the environment
+// the table of call sites is mapped on the first sample, profile_lock guards it
+static long profile_rate = -1;
+static struct profile_site *profile_sites;
+static size_t profile_site_count;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef OSMEM_DEBUG
+// mixed in the canaries, set with the configuration, and the poison pattern of the freed blocks
+static unsigned long debug_secret;
+static int debug_guard; // OSMEM_GUARD=1 puts a guard page after the mmap blocks
+static unsigned char debug_poison[DEBUG_POISON_SIZE];
+#endif
+
+// slot size of every slab class and the class of a request, by size rounded up to 16 bytes
+static const unsigned int slab_class_size[SLAB_CLASSES] = {
+	16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256
+};
+static const unsigned char slab_class_index[SLAB_MAX_SIZE / SLAB_CLASS_STEP + 1] = {
+	0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 8, 9, 9, 10, 10, 11, 11
+};
+
+// bounds of the sbrk heap
+static char *heap_start;
+static char *heap_end;
+// block ending the sbrk heap, the one to expand when the heap grows
+static struct block_meta *heap_last;
+// set once the break isn't heap_end anymore (another user of sbrk, the C library
+// in library mode), the sbrk heap stops growing and the main arena maps chunks instead
+static int heap_foreign_break;
+
+// leaves are mapped on first use
+static unsigned char *pagemap[1UL << PAGEMAP_ROOT_BITS];
 
 //------------------ HELPER MEMORY MANAGEMENT FUNCTION -----------------//
 
-// add memory block in list:
-// - heap blocks are added at the end of the list
-// - mmap blocks are added at the start of the list
-static void add_memory_block(struct block_meta *block)
+// payload size of a block
+static size_t block_size(struct block_meta *block)
 {
-	if (block->status == STATUS_MAPPED) {
-		if (head == NULL) {
-			head = block;
-		} else {
-			block->next = head;
-			head = block;
-		}
-	} else if (block->status == STATUS_ALLOC) {
-		if (head == NULL) {
-			head = block;
-		} else {
-			struct block_meta *current = head;
-			struct block_meta *prev = NULL;
+	return block->size & SIZE_MASK;
+}
 
-			while (current) {
-				prev = current;
-				current = current->next;
-			}
-			DIE(prev == NULL, strcat("Error adding heap block(STATUS_ALLOC) in:", __func__));
-			prev->next = block;
-		}
-	} else if (block->status == STATUS_FREE && heap_preallocated == 0) {
-		if (head == NULL) {
-			head = block;
-		} else {
-			struct block_meta *current = head;
-			struct block_meta *prev = NULL;
+static int block_status(struct block_meta *block)
+{
+	return block->size & STATUS_MASK;
+}
 
-			while (current) {
-				prev = current;
-				current = current->next;
-			}
-			DIE(prev == NULL, strcat("Error adding heap block(STATUS_FREE) in:", __func__));
-			prev->next = block;
-		}
-	} else {
-		DIE(1 == 1, strcat("Error trying to add mmap block in:", __func__));
-	}
+// change the payload size, keeping the status bits
+static void set_block_size(struct block_meta *block, size_t size)
+{
+	block->size = size | (block->size & ~SIZE_MASK);
+}
+
+static void set_block_status(struct block_meta *block, int status)
+{
+	block->size = (block->size & ~(size_t) STATUS_MASK) | status;
+}
+
+// free list links inside the payload of a FREE heap block
+static struct free_links *links_of(struct block_meta *block)
+{
+	return (struct free_links *)(block + 1);
+}
+
+// trie links inside the payload of a FREE heap block of a large bin
+static struct tree_links *tree_of(struct block_meta *block)
+{
+	return (struct tree_links *)(block + 1);
+}
+
+// mmap block holding a header
+static struct mapped_block *mapped_of(struct block_meta *block)
+{
+	return (struct mapped_block *)((char *) block - offsetof(struct mapped_block, meta));
+}
+
+// add an mmap block at the start of the list of mapped blocks, mapped_lock must be held
+static void add_mapped_block(struct mapped_block *map)
+{
+	map->prev = NULL;
+	map->next = mapped_blocks;
+	if (mapped_blocks)
+		mapped_blocks->prev = map;
+	mapped_blocks = map;
+	mapped_count++;
+	mapped_usable += block_size(&map->meta);
+	mapped_reserved += map->length;
 }
 
 // convert (void *) to (struct block_meta *)
@@ -74,315 +403,2768 @@ void *get_ptr_block(struct block_meta *block)
 	return (void *)(block + 1);
 }
 
-// remove memory block form list
-static void remove_memory_block(struct block_meta *block)
+// unlink an mmap block from the list of mapped blocks, mapped_lock must be held
+static void remove_mapped_block(struct mapped_block *map)
 {
-	struct block_meta *current = head;
-	struct block_meta *prev = NULL;
+	if (map->prev)
+		map->prev->next = map->next;
+	else
+		mapped_blocks = map->next;
+	if (map->next)
+		map->next->prev = map->prev;
+	map->prev = NULL;
+	map->next = NULL;
+	mapped_count--;
+	mapped_usable -= block_size(&map->meta);
+	mapped_reserved -= map->length;
+}
 
-	while (current) {
-		if (current == block) {
-			if (current == head)
-				head = head->next;
-			else
-				prev->next = block->next;
-			block->next = NULL;
-			break;
+// arena chunk holding a block that is not on the sbrk heap
+static struct arena_chunk *chunk_of(void *addr)
+{
+	return (struct arena_chunk *)((unsigned long) addr & ~(ARENA_CHUNK_SIZE - 1));
+}
+
+// page kind of an address, PAGE_NONE if it was never registered
+static unsigned char pagemap_get(void *addr)
+{
+	unsigned long page = (unsigned long) addr >> PAGEMAP_SHIFT;
+	unsigned long root = page >> PAGEMAP_LEAF_BITS;
+
+	if (root >= (1UL << PAGEMAP_ROOT_BITS))
+		return PAGE_NONE;
+
+	unsigned char *leaf = __atomic_load_n(&pagemap[root], __ATOMIC_ACQUIRE);
+
+	if (leaf == NULL)
+		return PAGE_NONE;
+	return __atomic_load_n(&leaf[page & ((1UL << PAGEMAP_LEAF_BITS) - 1)], __ATOMIC_RELAXED);
+}
+
+// set the page kind of an address
+// return 0 if its leaf could not be mapped, resetting a registered page to PAGE_NONE always succeeds
+static int pagemap_set(void *addr, unsigned char kind)
+{
+	unsigned long page = (unsigned long) addr >> PAGEMAP_SHIFT;
+	unsigned long root = page >> PAGEMAP_LEAF_BITS;
+
+	if (root >= (1UL << PAGEMAP_ROOT_BITS))
+		return 0;
+
+	unsigned char *leaf = __atomic_load_n(&pagemap[root], __ATOMIC_ACQUIRE);
+
+	if (leaf == NULL) {
+		unsigned char *expected = NULL;
+
+		leaf = mmap(NULL, 1UL << PAGEMAP_LEAF_BITS, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (leaf == MAP_FAILED)
+			return 0;
+		// another thread may install the leaf first
+		if (!__atomic_compare_exchange_n(&pagemap[root], &expected, leaf, 0,
+										 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			munmap(leaf, 1UL << PAGEMAP_LEAF_BITS);
+			leaf = expected;
+		}
+	}
+	__atomic_store_n(&leaf[page & ((1UL << PAGEMAP_LEAF_BITS) - 1)], kind, __ATOMIC_RELAXED);
+	return 1;
+}
+
+// set the page kind of every page of a range, return 0 and leave it unregistered on failure
+static int pagemap_set_range(char *start, size_t len, unsigned char kind)
+{
+	for (unsigned long offset = 0; offset < len; offset += 1UL << PAGEMAP_SHIFT) {
+		if (!pagemap_set(start + offset, kind)) {
+			while (offset > 0) {
+				offset -= 1UL << PAGEMAP_SHIFT;
+				pagemap_set(start + offset, PAGE_NONE);
+			}
+			return 0;
 		}
-		prev = current;
-		current = current->next;
 	}
+	return 1;
 }
 
-// check if a block is in list
+// check in O(1) if a block was handed out by the allocator:
+// - heap blocks must lie inside the sbrk heap and carry the header magic
+// - mmap blocks start on a page registered in the page map
+// - blocks of the other arenas lie in chunks registered in the page map
 int is_block_in_memory(struct block_meta *block)
 {
-	struct block_meta *current = head;
+	char *addr = (char *) block;
 
-	while (current) {
-		if (current == block)
-			return 1;
-		current = current->next;
+	if (addr >= heap_start && addr + BLOCK_META_SIZE <= heap_end)
+		return (addr - heap_start) % ALIGNMENT == 0 && block->magic == BLOCK_MAGIC;
+	switch (pagemap_get(addr)) {
+	case PAGE_MAPPED:
+		// the whole header lies on the registered page
+		return (unsigned long) addr % getpagesize() >= offsetof(struct mapped_block, meta) &&
+			   block->magic == BLOCK_MAGIC &&
+			   ((unsigned long) mapped_of(block) - mapped_of(block)->offset) % getpagesize() == 0;
+	case PAGE_ARENA:
+		return addr >= (char *) chunk_of(addr) + CHUNK_HEADER_SIZE &&
+			   (unsigned long) addr % ALIGNMENT == 0 && block->magic == BLOCK_MAGIC;
+	default:
+		return 0;
 	}
-	return 0;
 }
 
-// request memory space on heap if size + BLOCK_META_SIZE < MAP_THRESHOLD
-// or else allocate the pointer with mmap
-static struct block_meta *request_memory(size_t size)
+#ifdef OSMEM_DEBUG
+// canary of a live block header, its complement marks a block out of the quarantine
+static unsigned long debug_canary(struct block_meta *block)
 {
-	struct block_meta *block = NULL;
-	size_t total_size = ALIGN(size) + ALIGN(BLOCK_META_SIZE);
+	return ((unsigned long) block ^ debug_secret) * 0x9e3779b97f4a7c15UL;
+}
 
-	if (total_size < MAP_THRESHOLD)
-		block = (struct block_meta *) sbrk(total_size);
-	else
-		block = mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+// report a misused or corrupted pointer and stop, nothing is allocated on the way
+static void debug_report(const char *error, void *ptr)
+{
+	char buf[128];
+	int len = snprintf(buf, sizeof(buf), "osmem: %s: %p\n", error, ptr);
 
-	if (block == ALLOCATION_FAILED || block == NULL)
-		return NULL; // allocation failed.
+	if (len > 0)
+		len = write(STDERR_FILENO, buf, strlen(buf));
+	abort();
+}
 
-	block->size = ALIGN(size);
-	block->next = NULL;
+// check a pointer given to os_free or os_realloc, the header and the tail canary must be intact
+static void debug_check(void *ptr)
+{
+	struct block_meta *block = get_block_ptr(ptr);
+	unsigned long tail[2];
 
-	if (total_size < MAP_THRESHOLD)
-		block->status = STATUS_ALLOC;
-	else
-		block->status = STATUS_MAPPED;
-	return block;
+	if (!is_block_in_memory(block))
+		debug_report("invalid pointer or corrupted header", ptr);
+	if (block_status(block) == STATUS_FREE || (block->flags & BLOCK_QUARANTINED) ||
+		block->canary == ~debug_canary(block))
+		debug_report("double free", ptr);
+	if (block->canary != debug_canary(block) || block->requested + DEBUG_TAIL_SIZE > block_size(block))
+		debug_report("corrupted header", ptr);
+	tail[0] = tail[1] = block->canary;
+	if (memcmp((char *) ptr + block->requested, tail, DEBUG_TAIL_SIZE) != 0)
+		debug_report("write past the end of the block", ptr);
+}
+
+// take the oldest block out of the quarantine of a thread, it must still be poisoned
+// its canary is inverted, a later free is a double free until it is allocated again
+static void *quarantine_pop(struct thread_cache *cache)
+{
+	void *ptr = cache->quarantine[cache->quarantine_head];
+	struct block_meta *block = get_block_ptr(ptr);
+	size_t poisoned = (block->requested < DEBUG_POISON_SIZE) ? block->requested : DEBUG_POISON_SIZE;
+
+	cache->quarantine_head = (cache->quarantine_head + 1) % QUARANTINE_ENTRIES;
+	cache->quarantine_count--;
+	cache->quarantine_bytes -= block_size(block);
+	if (block->canary != debug_canary(block))
+		debug_report("corrupted header of a freed block", ptr);
+	if (memcmp(ptr, debug_poison, poisoned) != 0)
+		debug_report("write after free", ptr);
+	block->flags &= ~BLOCK_QUARANTINED;
+	block->canary = ~debug_canary(block);
+	return ptr;
 }
+#endif
 
-// preallocate a heap of 128kb with header size included
-static void preallocate_heap(void)
+// size class of a free heap block
+static int bin_index(size_t size)
 {
-	struct block_meta *heap = (struct block_meta *) sbrk(PREALLOC_SIZE);
+	if (size < SMALL_BIN_LIMIT)
+		return size / ALIGNMENT;
+
+	// the bits right after the most significant one select the range inside a power of two
+	int msb = BITS_PER_LONG - 1 - __builtin_clzl(size);
+	size_t range = (size >> (msb - BIN_SUBDIVISIONS_LOG)) & ((1 << BIN_SUBDIVISIONS_LOG) - 1);
+	size_t index = SMALL_BINS + ((msb - __builtin_ctzl(SMALL_BIN_LIMIT)) << BIN_SUBDIVISIONS_LOG) + range;
 
-	DIE(heap == NULL, strcat("Error heap preallocation in:", __func__));
-	heap->size = PREALLOC_SIZE - ALIGN(BLOCK_META_SIZE);
-	heap->next = NULL;
-	heap->status = STATUS_FREE;
-	add_memory_block(heap);
+	return (index < NUM_BINS) ? index : NUM_BINS - 1;
 }
 
-// coalesce 2 blocks (it will be called for adjenct blocks)
-static void coalesce_blocks(struct block_meta *block1, struct block_meta *block2)
+// highest size bit telling apart the blocks of a large bin, the bits above it select the bin
+static int tree_top_bit(int index)
 {
-	block1->size += block2->size + ALIGN(BLOCK_META_SIZE);
-	block1->next = block2->next;
-	block1->status = STATUS_FREE;
+	// the last bin also holds every larger size
+	if (index == NUM_BINS - 1)
+		return BITS_PER_LONG - 1;
+	return ((index - SMALL_BINS) >> BIN_SUBDIVISIONS_LOG) + __builtin_ctzl(SMALL_BIN_LIMIT) - BIN_SUBDIVISIONS_LOG - 1;
 }
 
-// coalesces adjenct memory blocks
-static void coalesce_memory(void)
+// add a FREE block to the trie of a large bin, as a new leaf or after the node of its size
+static void tree_insert(struct arena *arena, int index, struct block_meta *block)
 {
-	struct block_meta *current = head;
+	struct tree_links *tree = tree_of(block);
+	struct block_meta **slot = &arena->free_bins[index];
+	struct block_meta *parent = NULL;
+	size_t size = block_size(block);
+
+	tree->list.prev_free = NULL;
+	tree->list.next_free = NULL;
+	tree->child[0] = NULL;
+	tree->child[1] = NULL;
+	tree->parent = NULL;
 
-	while (current && current->next) {
-		if (current->status == STATUS_FREE && current->next->status == STATUS_FREE)
-			coalesce_blocks(current, current->next);
-		current = current->next;
+	for (int bit = tree_top_bit(index); *slot; bit--) {
+		struct tree_links *node = tree_of(*slot);
+
+		if (block_size(*slot) == size) {
+			tree->list.prev_free = *slot;
+			tree->list.next_free = node->list.next_free;
+			if (node->list.next_free)
+				links_of(node->list.next_free)->prev_free = block;
+			node->list.next_free = block;
+			return;
+		}
+		parent = *slot;
+		slot = &node->child[(size >> bit) & 1];
 	}
+	tree->parent = parent;
+	*slot = block;
 }
 
-// attempt to split the block if possible for better memory management
-// if a split can't be made, mark the memory as being allocated and used
-// size = block_meta + payload + padding (alignment of 8 bytes)
-static void split_block(struct block_meta *block, size_t size)
+// unlink a FREE block from the trie of a large bin
+static void tree_remove(struct arena *arena, int index, struct block_meta *block)
 {
-	if (block->size >= ALIGN(size) + ALIGN(BLOCK_META_SIZE) + ALIGNMENT) {
-		struct block_meta *new_block = (struct block_meta *)((char *)block + ALIGN(BLOCK_META_SIZE) + ALIGN(size));
+	struct tree_links *tree = tree_of(block);
+	struct block_meta *replacement = NULL;
 
-		new_block->size = block->size - ALIGN(size) - ALIGN(BLOCK_META_SIZE);
-		new_block->next = block->next;
-		new_block->status = STATUS_FREE;
-
-		block->size = ALIGN(size);
-		block->next = new_block;
-		block->status = STATUS_ALLOC;
+	if (tree->list.prev_free) {
+		// the block follows a node, the trie doesn't change
+		links_of(tree->list.prev_free)->next_free = tree->list.next_free;
+		if (tree->list.next_free)
+			links_of(tree->list.next_free)->prev_free = tree->list.prev_free;
 	} else {
-		block->status = STATUS_ALLOC;
+		if (tree->list.next_free) {
+			// the next block of the same size becomes the node
+			replacement = tree->list.next_free;
+			links_of(replacement)->prev_free = NULL;
+		} else if (tree->child[0] || tree->child[1]) {
+			// any leaf below the node shares the size bits of its path, it takes its place
+			struct block_meta **leaf = tree->child[1] ? &tree->child[1] : &tree->child[0];
+
+			while (tree_of(*leaf)->child[0] || tree_of(*leaf)->child[1])
+				leaf = tree_of(*leaf)->child[1] ? &tree_of(*leaf)->child[1] : &tree_of(*leaf)->child[0];
+			replacement = *leaf;
+			*leaf = NULL;
+		}
+
+		if (replacement) {
+			struct tree_links *node = tree_of(replacement);
+
+			for (int i = 0; i < 2; i++) {
+				node->child[i] = tree->child[i];
+				if (node->child[i])
+					tree_of(node->child[i])->parent = replacement;
+			}
+			node->parent = tree->parent;
+		}
+		if (tree->parent == NULL)
+			arena->free_bins[index] = replacement;
+		else
+			tree_of(tree->parent)->child[tree_of(tree->parent)->child[1] == block] = replacement;
 	}
+
+	tree->list.prev_free = NULL;
+	tree->list.next_free = NULL;
+	tree->child[0] = NULL;
+	tree->child[1] = NULL;
+	tree->parent = NULL;
 }
 
-// return the best fitting block in memory if exists, otherwise NULL
-static struct block_meta *find_best_free_block(struct block_meta **last, size_t size)
+// smallest block of a trie, on the path that always takes the lower child
+static struct block_meta *tree_smallest(struct block_meta *node)
+{
+	struct block_meta *best = node;
+
+	for (; node; node = tree_of(node)->child[0] ? tree_of(node)->child[0] : tree_of(node)->child[1])
+		if (block_size(node) < block_size(best))
+			best = node;
+	return best;
+}
+
+// largest block of a trie, on the path that always takes the upper child
+static struct block_meta *tree_largest(struct block_meta *node)
+{
+	struct block_meta *best = node;
+
+	for (; node; node = tree_of(node)->child[1] ? tree_of(node)->child[1] : tree_of(node)->child[0])
+		if (block_size(node) > block_size(best))
+			best = node;
+	return best;
+}
+
+// smallest block of the trie of a large bin holding at least size bytes, NULL if there is none
+static struct block_meta *tree_best_fit(struct arena *arena, int index, size_t size)
 {
-	struct block_meta *current = head;
+	struct block_meta *node = arena->free_bins[index];
 	struct block_meta *best = NULL;
+	// deepest upper subtree left by the path: its sizes are all larger than size,
+	// and smaller than the ones of the upper subtrees left before it
+	struct block_meta *upper = NULL;
 
-	// coalesce memory before search
-	coalesce_memory();
-	while (current) {
-		if (current->status == STATUS_FREE && current->size >= size) {
-			if (best == NULL)
-				best = current;
-			else if (best->size > current->size)
-				best = current;
-		}
-		*last = current;
-		current = current->next;
+	for (int bit = tree_top_bit(index); node; bit--) {
+		struct tree_links *tree = tree_of(node);
+		int direction = (size >> bit) & 1;
+
+		if (block_size(node) >= size && (best == NULL || block_size(node) < block_size(best)))
+			best = node;
+		if (block_size(node) == size)
+			return node;
+		if (direction == 0 && tree->child[1])
+			upper = tree->child[1];
+		node = tree->child[direction];
 	}
 
+	upper = tree_smallest(upper);
+	if (upper && (best == NULL || block_size(upper) < block_size(best)))
+		best = upper;
 	return best;
 }
 
-// find last block in list and check if is a FREE block
-static struct block_meta *find_last_free_block(void)
+// add a FREE heap block to its size class, at the front of the list of a small bin
+static void insert_free_block(struct arena *arena, struct block_meta *block)
 {
-	struct block_meta *prev = NULL;
-	struct block_meta *current = head;
+	int index = bin_index(block_size(block));
+	struct free_links *links = links_of(block);
 
-	while (current) {
-		prev = current;
-		current = current->next;
+	arena->bin_map[index / BITS_PER_LONG] |= 1UL << (index % BITS_PER_LONG);
+	arena->free_bytes += block_size(block);
+	if (index >= SMALL_BINS) {
+		tree_insert(arena, index, block);
+		return;
 	}
-	if (prev->status == STATUS_FREE)
-		return prev;
-	return NULL;
+
+	links->prev_free = NULL;
+	links->next_free = arena->free_bins[index];
+	if (arena->free_bins[index])
+		links_of(arena->free_bins[index])->prev_free = block;
+	arena->free_bins[index] = block;
 }
 
-// min on size_t type
-size_t min(size_t a, size_t b)
+// unlink a FREE heap block from its size class
+static void remove_free_block(struct arena *arena, struct block_meta *block)
 {
-	return (a < b) ? a : b;
+	int index = bin_index(block_size(block));
+	struct free_links *links = links_of(block);
+
+	if (index >= SMALL_BINS) {
+		tree_remove(arena, index, block);
+	} else {
+		if (links->prev_free)
+			links_of(links->prev_free)->next_free = links->next_free;
+		else
+			arena->free_bins[index] = links->next_free;
+		if (links->next_free)
+			links_of(links->next_free)->prev_free = links->prev_free;
+		links->prev_free = NULL;
+		links->next_free = NULL;
+	}
+	if (arena->free_bins[index] == NULL)
+		arena->bin_map[index / BITS_PER_LONG] &= ~(1UL << (index % BITS_PER_LONG));
+	arena->free_bytes -= block_size(block);
 }
 
-//----------------------------------------------------------------------//
+// first non empty bin starting with index, -1 if there is none
+static int next_nonempty_bin(struct arena *arena, int index)
+{
+	for (size_t word = index / BITS_PER_LONG; word < BINMAP_WORDS; word++) {
+		unsigned long bits = arena->bin_map[word];
 
-void *os_malloc(size_t size)
+		if (word == index / BITS_PER_LONG)
+			bits &= ~0UL << (index % BITS_PER_LONG);
+		if (bits)
+			return word * BITS_PER_LONG + __builtin_ctzl(bits);
+	}
+	return -1;
+}
+
+// owner arena of a heap block
+static struct arena *arena_of(struct block_meta *block)
 {
-	/* TODO: Implement os_malloc */
-	if (size == 0)
+	if ((char *) block >= heap_start && (char *) block < heap_end)
+		return main_arena;
+	return chunk_of(block)->arena;
+}
+
+// bounds of the contiguous memory holding a heap block: the sbrk heap or an arena chunk
+static void heap_segment(struct block_meta *block, char **start, char **end)
+{
+	if ((char *) block >= heap_start && (char *) block < heap_end) {
+		*start = heap_start;
+		*end = heap_end;
+	} else {
+		*start = (char *) chunk_of(block) + CHUNK_HEADER_SIZE;
+		*end = (char *) chunk_of(block) + ARENA_CHUNK_SIZE;
+	}
+}
+
+// physically adjacent heap block after block, NULL for the last one
+static struct block_meta *next_heap_block(struct block_meta *block)
+{
+	char *next = (char *) block + BLOCK_META_SIZE + block_size(block);
+	char *start, *end;
+
+	heap_segment(block, &start, &end);
+	return (next + BLOCK_META_SIZE <= end) ? (struct block_meta *) next : NULL;
+}
+
+// physically adjacent heap block before block if it is FREE, found through its footer
+static struct block_meta *prev_free_block(struct block_meta *block)
+{
+	if (!(block->size & BLOCK_PREV_FREE))
 		return NULL;
 
-	size_t total_size = ALIGN(size) + ALIGN(BLOCK_META_SIZE);
-	struct block_meta *block = NULL;
+	size_t prev_size = *((size_t *) block - 1);
 
-	if (total_size < MAP_THRESHOLD) {
-		if (!heap_preallocated) {
-			preallocate_heap();
-			heap_preallocated = 1;
-		}
+	return (struct block_meta *)((char *) block - BLOCK_META_SIZE - prev_size);
+}
 
-		struct block_meta *last = head;
+// mark a heap block FREE: write the boundary tag at its end and flag it in the next block
+static void set_block_free(struct block_meta *block)
+{
+	struct block_meta *next = next_heap_block(block);
 
-		block = find_best_free_block(&last, ALIGN(size));
+	set_block_status(block, STATUS_FREE);
+	*(size_t *)((char *) get_ptr_block(block) + block_size(block) - FOOTER_SIZE) = block_size(block);
+	if (next)
+		next->size |= BLOCK_PREV_FREE;
+}
 
-		if (block) {
-			// found a memory block on the prealloacated heap
-			// try to split the block, otherwise the function will mark the zone as in use
-			split_block(block, size);
-		} else {
-			// try to expand the last free block
-			struct block_meta *last = find_last_free_block();
-
-			if (last == NULL) {
-				// there is no free block to expand
-				// request additional memory and add it in the list of memory management
-				block = request_memory(size);
-				DIE(block == NULL, strcat("Error request new heap block in:", __func__));
-				add_memory_block(block);
-			} else {
-				// found a block to expand at the end of the heap
-				block = request_memory(size - last->size - ALIGN(BLOCK_META_SIZE));
-				DIE(block == NULL, strcat("Error expanding heap block in:", __func__));
-				block->status = STATUS_FREE;
-				coalesce_blocks(last, block);
-				block = last;
-				block->status = STATUS_ALLOC;
-			}
-		}
-	} else {
-		// request additional memory and add it in the list of memory management
-		block = request_memory(size);
-		DIE(block == NULL, strcat("Error request new mmap block in:", __func__));
-		add_memory_block(block);
+// mark a heap block as allocated, the next block no longer has a FREE neighbour
+static void set_block_used(struct block_meta *block)
+{
+	struct block_meta *next = next_heap_block(block);
+
+	set_block_status(block, STATUS_ALLOC);
+	if (next)
+		next->size &= ~BLOCK_PREV_FREE;
+}
+
+// huge page mode of the process
+static int huge_pages(void)
+{
+	int mode = __atomic_load_n(&thp_mode, __ATOMIC_RELAXED);
+
+	if (mode < 0) {
+		const char *env = getenv("OSMEM_THP");
+
+		mode = THP_OFF;
+		if (env && (strcmp(env, "madvise") == 0 || strcmp(env, "1") == 0))
+			mode = THP_MADVISE;
+		else if (env && strcmp(env, "hugetlb") == 0)
+			mode = THP_HUGETLB;
+		__atomic_store_n(&thp_mode, mode, __ATOMIC_RELAXED);
 	}
+	return mode;
+}
 
-	return get_ptr_block(block);
+// ask for transparent huge pages over the pages lying entirely inside [start, end)
+static void advise_huge_pages(char *start, char *end)
+{
+	unsigned long page_size = getpagesize();
+	char *first = (char *)(((unsigned long) start + page_size - 1) & ~(page_size - 1));
+	char *last = (char *)((unsigned long) end & ~(page_size - 1));
+
+	if (huge_pages() != THP_OFF && first < last)
+		madvise(first, last - first, MADV_HUGEPAGE);
 }
 
-void os_free(void *ptr)
+// map len bytes aligned to align, MAP_FAILED on failure
+static void *map_aligned(size_t len, size_t align, int flags)
 {
-	/* TODO: Implement os_free */
-	if (ptr == NULL)
-		return;
+	// map more to find an aligned start and give back the rest
+	char *map = mmap(NULL, len + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
 
-	struct block_meta *block = get_block_ptr(ptr);
+	if (map == MAP_FAILED)
+		return MAP_FAILED;
 
-	if (!is_block_in_memory(block))
-		return;
-	if (block->status == STATUS_ALLOC) {
-		block->status = STATUS_FREE;
-		coalesce_memory();
-	} else if (block->status == STATUS_MAPPED) {
-		remove_memory_block(block);
+	char *start = (char *)(((unsigned long) map + align - 1) & ~(align - 1));
 
-		size_t len = block->size + BLOCK_META_SIZE;
-		int ret = munmap((void *) block, len);
+	if (start > map)
+		munmap(map, start - map);
+	munmap(start + len, map + align - start);
+	return start;
+}
 
-		DIE(ret != 0, strcat("Error munmap in:", __func__));
-	}
+// bytes to add at end of the sbrk heap for size bytes, in huge page mode the heap
+// stays aligned to HUGE_PAGE_SIZE so every full huge page inside it can be used
+static size_t heap_growth(size_t size)
+{
+	unsigned long end = (unsigned long) sbrk(0);
+
+	if (huge_pages() == THP_OFF)
+		return size;
+	return ((end + size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1)) - end;
 }
 
-void *os_calloc(size_t nmemb, size_t size)
+// payload of a heap block serving size bytes, it must hold the links and footer once freed
+static size_t heap_payload(size_t size)
+{
+	return (size > MIN_PAYLOAD) ? ALIGN(size) : ALIGN(MIN_PAYLOAD);
+}
+
+// payload of an mmap block serving size bytes, the mapping is rounded up to whole pages,
+// or to whole huge pages in huge page mode once it is at least that large
+static size_t mapped_payload(size_t size)
 {
-	MAP_THRESHOLD = getpagesize();
-	void *ptr = os_malloc(nmemb * size);
+	size_t page_size = getpagesize();
 
-	MAP_THRESHOLD = 128 * 1024;
+	if (huge_pages() != THP_OFF && MAPPED_HEADER_SIZE + ALIGN(size) >= HUGE_PAGE_SIZE)
+		page_size = HUGE_PAGE_SIZE;
 
-	if (ptr == NULL)
-		return NULL;
-	memset(ptr, 0, nmemb * size);
-	return ptr;
+	return ((MAPPED_HEADER_SIZE + ALIGN(size) + page_size - 1) & ~(page_size - 1)) - MAPPED_HEADER_SIZE;
 }
 
-void *os_realloc(void *ptr, size_t size)
+// write the header of an mmap block with a payload of size bytes
+// return NULL and unmap it if the page map can't register it
+static struct block_meta *init_mapped_block(struct mapped_block *map, size_t offset, size_t len,
+											size_t size, unsigned int flags)
 {
-	/* TODO: Implement os_realloc */
-	if (ptr == NULL)
-		return os_malloc(size);
+	struct block_meta *block = &map->meta;
 
-	if (size == 0) {
-		os_free(ptr);
+	if (!pagemap_set(map, PAGE_MAPPED)) {
+		munmap((char *) map - offset, len);
 		return NULL;
 	}
+	map->prev = NULL;
+	map->next = NULL;
+	map->offset = offset;
+	map->length = len;
+	block->size = size | STATUS_MAPPED;
+	block->magic = BLOCK_MAGIC;
+	block->flags = flags;
+	return block;
+}
 
-	struct block_meta *block = get_block_ptr(ptr);
-	void *new_ptr = NULL;
+// coarse monotonic time in ns, enough to age the cached mappings
+static unsigned long cache_clock(void)
+{
+	struct timespec now;
 
-	if (block->status == STATUS_FREE)
-		return NULL;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
 
-	size = ALIGN(size);
-	// do nothing if size didn't change
-	if (block->size == size)
-		return ptr;
+// take the cached mappings that timed out out of the cache, and the oldest ones until
+// length more bytes fit in it, mapped_lock must be held
+// they go to evicted for the caller to unmap without the lock, return their number
+static int mmap_cache_evict(unsigned long now, size_t length, struct mmap_cache_entry *evicted)
+{
+	int count = 0;
 
-	// on heap realloc
-	if (block->status == STATUS_ALLOC) {
-		if (block->size > size) {
-			// truncate the block and try to split it
-			split_block(block, size);
-			new_ptr = get_ptr_block(block);
-		} else {
-			// try to expand the block
-			coalesce_memory();
-			if (block->next && block->next->status == STATUS_FREE &&
-				block->size + block->next->size + ALIGN(BLOCK_META_SIZE) >= size) {
-				// expand the zone
-				block->size += block->next->size + ALIGN(BLOCK_META_SIZE);
-				block->next = block->next->next;
-				block->status = STATUS_ALLOC;
-				// split the zone after to future reuse
-				split_block(block, size);
-				new_ptr = get_ptr_block(block);
-			} else if (block->next == NULL) {
-				// the block on the heap is the last one so we need just to
-				// expand with additional size
-				os_free(get_ptr_block(block));
-				new_ptr = os_malloc(size);
-				if (new_ptr == NULL)
-					return NULL;
-				memmove(new_ptr, get_ptr_block(block), min(block->size, size));
-			} else {
-				// could not expand the block
-				// remove it from memory, coalesce memory and try to find a new place for it
-				new_ptr = os_malloc(size);
-				if (new_ptr == NULL)
-					return NULL;
-				memmove(new_ptr, get_ptr_block(block), min(block->size, size));
-				os_free(get_ptr_block(block));
+	for (;;) {
+		struct mmap_cache_entry *oldest = NULL;
+		int used = 0;
+
+		for (int i = 0; i < MMAP_CACHE_ENTRIES; i++) {
+			struct mmap_cache_entry *entry = &mmap_cache[i];
+
+			if (entry->map && now - entry->released > MMAP_CACHE_TIMEOUT) {
+				mmap_cache_bytes -= entry->length;
+				evicted[count++] = *entry;
+				entry->map = NULL;
 			}
+			if (entry->map == NULL)
+				continue;
+			used++;
+			if (oldest == NULL || entry->released < oldest->released)
+				oldest = entry;
 		}
-	} else if (block->status == STATUS_MAPPED) {
-		new_ptr = os_malloc(size);
-		if (new_ptr == NULL)
-			return NULL;
-		memmove(new_ptr, get_ptr_block(block), min(block->size, size));
-		os_free(get_ptr_block(block));
+		if (length == 0 ||
+			(used < MMAP_CACHE_ENTRIES && mmap_cache_bytes + length <= __atomic_load_n(&mmap_cache_size, __ATOMIC_RELAXED)))
+			return count;
+
+		mmap_cache_bytes -= oldest->length;
+		evicted[count++] = *oldest;
+		oldest->map = NULL;
 	}
+}
 
-	return new_ptr;
+// note when the oldest cached mapping times out, mapped_lock must be held
+static void mmap_cache_set_expiry(void)
+{
+	unsigned long expiry = 0;
+
+	for (int i = 0; i < MMAP_CACHE_ENTRIES; i++)
+		if (mmap_cache[i].map && (expiry == 0 || mmap_cache[i].released + MMAP_CACHE_TIMEOUT < expiry))
+			expiry = mmap_cache[i].released + MMAP_CACHE_TIMEOUT;
+	__atomic_store_n(&mmap_cache_expiry, expiry, __ATOMIC_RELAXED);
+}
+
+// unmap the mappings evicted from the cache
+static void mmap_cache_unmap(struct mmap_cache_entry *evicted, int count)
+{
+	for (int i = 0; i < count; i++)
+		DIE(munmap(evicted[i].map, evicted[i].length) != 0, "Error munmap");
+}
+
+// mmap block of size bytes in the most recently released mapping of the same length,
+// NULL if none is cached, its payload holds old data and isn't flagged BLOCK_ZEROED
+static struct block_meta *mmap_cache_get(size_t size)
+{
+	struct mmap_cache_entry evicted[MMAP_CACHE_ENTRIES];
+	struct mmap_cache_entry *found = NULL;
+	struct block_meta *block = NULL;
+	size_t length;
+
+	size = mapped_payload(size);
+	length = MAPPED_HEADER_SIZE + size;
+
+	pthread_mutex_lock(&mapped_lock);
+	int count = mmap_cache_evict(cache_clock(), 0, evicted);
+
+	for (int i = 0; i < MMAP_CACHE_ENTRIES; i++) {
+		struct mmap_cache_entry *entry = &mmap_cache[i];
+
+		if (entry->map && entry->length == length && (found == NULL || entry->released > found->released))
+			found = entry;
+	}
+	if (found) {
+		block = init_mapped_block(found->map, 0, length, size, found->flags);
+		mmap_cache_bytes -= found->length;
+		found->map = NULL;
+	}
+	mmap_cache_set_expiry();
+	pthread_mutex_unlock(&mapped_lock);
+
+	mmap_cache_unmap(evicted, count);
+	return block;
+}
+
+// release the mapping of an mmap block, it is kept in the cache if it takes at most
+// a quarter of it, aligned blocks don't start their mapping, buffers grown by realloc
+// won't be requested at that length again and guarded blocks end with their guard page,
+// they are always unmapped
+// return 1 if the mapping was cached
+static int mmap_cache_put(struct mapped_block *map)
+{
+	struct mmap_cache_entry evicted[MMAP_CACHE_ENTRIES];
+	unsigned long now = cache_clock();
+	int count = 0;
+
+	if (map->offset != 0 || map->length > __atomic_load_n(&mmap_cache_size, __ATOMIC_RELAXED) / 4 ||
+		(map->meta.flags & (BLOCK_RESIZED | BLOCK_GUARDED))) {
+		DIE(munmap((char *) map - map->offset, map->length) != 0, "Error munmap");
+		return 0;
+	}
+
+	pthread_mutex_lock(&mapped_lock);
+	count = mmap_cache_evict(now, map->length, evicted);
+	for (int i = 0; i < MMAP_CACHE_ENTRIES; i++) {
+		struct mmap_cache_entry *entry = &mmap_cache[i];
+
+		if (entry->map == NULL) {
+			entry->map = map;
+			entry->length = map->length;
+			entry->flags = map->meta.flags & BLOCK_HUGETLB;
+			entry->released = now;
+			mmap_cache_bytes += map->length;
+			break;
+		}
+	}
+	mmap_cache_set_expiry();
+	pthread_mutex_unlock(&mapped_lock);
+
+	mmap_cache_unmap(evicted, count);
+	return 1;
+}
+
+// unmap the cached mappings that timed out, called on the slow paths of the heap too
+// so that a process that stopped mapping blocks gives them back
+// it costs a load while the cache is empty, and a coarse clock read until the next timeout
+static void mmap_cache_expire(void)
+{
+	struct mmap_cache_entry evicted[MMAP_CACHE_ENTRIES];
+	unsigned long expiry = __atomic_load_n(&mmap_cache_expiry, __ATOMIC_RELAXED);
+	unsigned long now;
+	int count;
+
+	if (expiry == 0 || (now = cache_clock()) < expiry)
+		return;
+
+	pthread_mutex_lock(&mapped_lock);
+	count = mmap_cache_evict(now, 0, evicted);
+	mmap_cache_set_expiry();
+	pthread_mutex_unlock(&mapped_lock);
+
+	mmap_cache_unmap(evicted, count);
+}
+
+#ifdef OSMEM_DEBUG
+// new mapping for an mmap block of size bytes ending right before a PROT_NONE page
+// the header stays on a single page for the page map, the payload moves down if it would not
+static struct block_meta *map_guarded(size_t size)
+{
+	unsigned long page_size = getpagesize();
+	size_t len = ((MAPPED_HEADER_SIZE + ALIGN(size) + page_size - 1) & ~(page_size - 1)) + page_size;
+	char *start = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (start == MAP_FAILED)
+		return NULL; // allocation failed.
+
+	char *guard = start + len - page_size;
+	char *payload = guard - ALIGN(size);
+
+	if (((unsigned long) payload - MAPPED_HEADER_SIZE) / page_size != ((unsigned long) payload - 1) / page_size)
+		payload = (char *)((unsigned long) payload & ~(page_size - 1));
+	DIE(mprotect(guard, page_size, PROT_NONE) != 0, "Error mprotect");
+
+	struct mapped_block *map = (struct mapped_block *)(payload - MAPPED_HEADER_SIZE);
+
+	return init_mapped_block(map, (char *) map - start, len, guard - payload, BLOCK_ZEROED | BLOCK_GUARDED);
+}
+
+#endif
+// new mapping for an mmap block of size bytes with the payload aligned to alignment
+static struct block_meta *map_block(size_t size, size_t alignment)
+{
+	unsigned long page_size = getpagesize();
+	size_t len, offset = 0;
+	unsigned int flags = BLOCK_ZEROED; // pages fresh from the kernel
+	struct mapped_block *map = MAP_FAILED;
+
+#ifdef OSMEM_DEBUG
+	if (alignment <= ALIGNMENT && debug_guard)
+		return map_guarded(size);
+#endif
+	if (alignment <= ALIGNMENT) {
+		size = mapped_payload(size);
+		len = MAPPED_HEADER_SIZE + size;
+		int huge = huge_pages() != THP_OFF && len % HUGE_PAGE_SIZE == 0;
+
+		if (huge && huge_pages() == THP_HUGETLB) {
+			map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (map != MAP_FAILED)
+				flags |= BLOCK_HUGETLB;
+		}
+		if (map == MAP_FAILED && huge) {
+			map = map_aligned(len, HUGE_PAGE_SIZE, 0);
+			if (map != MAP_FAILED)
+				advise_huge_pages((char *) map, (char *) map + len);
+		}
+		if (map == MAP_FAILED)
+			map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (map == MAP_FAILED)
+			return NULL; // allocation failed.
+	} else {
+		// map enough for any position of the payload, then give back the pages around it
+		len = (MAPPED_HEADER_SIZE + ALIGN(size) + alignment + page_size - 1) & ~(page_size - 1);
+		char *base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (base == MAP_FAILED)
+			return NULL; // allocation failed.
+
+		char *payload = (char *)(((unsigned long) base + MAPPED_HEADER_SIZE + alignment - 1) & ~(alignment - 1));
+		char *start = (char *)(((unsigned long) payload - MAPPED_HEADER_SIZE) & ~(page_size - 1));
+		char *end = (char *)(((unsigned long) payload + ALIGN(size) + page_size - 1) & ~(page_size - 1));
+
+		if (start > base)
+			munmap(base, start - base);
+		if (base + len > end)
+			munmap(end, base + len - end);
+		map = (struct mapped_block *)(payload - MAPPED_HEADER_SIZE);
+		offset = (char *) map - start;
+		len = end - start;
+		size = end - payload;
+	}
+
+	return init_mapped_block(map, offset, len, size, flags);
+}
+
+// request memory space on the sbrk heap, or a new mapping for a mapped block
+// the heap grows by whole steps, so the block may be larger than size and should be split
+static struct block_meta *request_memory(size_t size, int mapped)
+{
+	struct block_meta *block = NULL;
+
+	if (mapped)
+		return map_block(size, ALIGNMENT);
+
+	size = heap_payload(size);
+	if (size < heap_grow_size)
+		size = heap_grow_size;
+	size = heap_growth(BLOCK_META_SIZE + size) - BLOCK_META_SIZE;
+	// the new memory is merged with the heap, it must start at its end
+	if (sbrk(0) != heap_end) {
+		heap_foreign_break = 1;
+		return NULL;
+	}
+	block = (struct block_meta *) sbrk(BLOCK_META_SIZE + size);
+	if (block == ALLOCATION_FAILED || block == NULL)
+		return NULL; // allocation failed.
+	if ((char *) block != heap_end) {
+		// the break moved in the meantime, give the memory back while it is on top
+		if (sbrk(0) == (char *) block + BLOCK_META_SIZE + size)
+			sbrk(-(intptr_t)(BLOCK_META_SIZE + size));
+		heap_foreign_break = 1;
+		return NULL;
+	}
+	advise_huge_pages((char *) block, (char *) block + BLOCK_META_SIZE + size);
+	// the heap never ends with a FREE block when it grows by a new one
+	block->size = size | STATUS_ALLOC;
+	heap_end = (char *) block + BLOCK_META_SIZE + size;
+	heap_last = block;
+	block->magic = BLOCK_MAGIC;
+	block->flags = BLOCK_ZEROED; // pages fresh from the kernel
+	return block;
+}
+
+// preallocate a heap of prealloc_size bytes (128kb by default) with header size included
+// return 0 if sbrk failed
+static int preallocate_heap(void)
+{
+	// the break may not be aligned yet
+	size_t size = heap_growth(ALIGNMENT + prealloc_size);
+	char *start = sbrk(size);
+
+	if (start == ALLOCATION_FAILED)
+		return 0;
+	size_t pad = -(unsigned long) start & (ALIGNMENT - 1);
+	struct block_meta *heap = (struct block_meta *)(start + pad);
+
+	heap->size = size - pad - BLOCK_META_SIZE;
+	heap->magic = BLOCK_MAGIC;
+	heap->flags = BLOCK_ZEROED;
+	heap_start = (char *) heap;
+	heap_end = start + size;
+	advise_huge_pages(heap_start, heap_end);
+	heap_last = heap;
+	set_block_free(heap);
+	insert_free_block(main_arena, heap);
+	return 1;
+}
+
+// memory node of an arena in NUMA mode, -1 for the main arena which has none
+static int arena_node(struct arena *arena)
+{
+	if (arena == main_arena)
+		return -1;
+	return (arena - arenas - 1) % numa_count;
+}
+
+// number of memory nodes if NUMA mode is asked for with OSMEM_NUMA=1, 0 otherwise
+// read with plain system calls, stdio would allocate before the arenas are ready
+static int numa_nodes(void)
+{
+	const char *env = getenv("OSMEM_NUMA");
+	char buf[256];
+	int nodes = 0, node = 0;
+
+	if (env == NULL || strcmp(env, "1") != 0)
+		return 0;
+
+	int fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+	ssize_t len = (fd >= 0) ? read(fd, buf, sizeof(buf) - 1) : -1;
+
+	if (fd >= 0)
+		close(fd);
+	if (len <= 0)
+		return 1;
+
+	// a list of ranges like "0-3,8-11", the highest node tells how many there are
+	for (ssize_t i = 0; i < len; i++) {
+		if (buf[i] >= '0' && buf[i] <= '9') {
+			node = node * 10 + buf[i] - '0';
+		} else {
+			nodes = (node + 1 > nodes) ? node + 1 : nodes;
+			node = 0;
+		}
+	}
+	nodes = (node + 1 > nodes) ? node + 1 : nodes;
+	return (nodes < MAX_NUMA_NODES) ? nodes : MAX_NUMA_NODES;
+}
+
+// memory node of the CPU running the thread, in NUMA mode
+static int current_node(void)
+{
+	unsigned int cpu, node;
+
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+		return 0;
+	return node % numa_count;
+}
+
+// prefer the node of the arena for the pages of [start, start + len) not touched yet
+// a failing mbind leaves them to first touch, by the threads of that node in practice
+static void bind_to_node(struct arena *arena, void *start, size_t len)
+{
+	if (numa_count == 0 || arena == main_arena)
+		return;
+
+	unsigned long mask = 1UL << arena_node(arena);
+
+	syscall(SYS_mbind, start, len, MPOL_PREFERRED, &mask, BITS_PER_LONG, 0);
+}
+
+// map a new chunk for an arena, all of it as a single FREE block
+static int add_arena_chunk(struct arena *arena)
+{
+	char *start = map_aligned(ARENA_CHUNK_SIZE, ARENA_CHUNK_SIZE, MAP_NORESERVE);
+
+	if (start == MAP_FAILED)
+		return 0;
+	bind_to_node(arena, start, ARENA_CHUNK_SIZE);
+	// chunks are aligned to their size, so to huge pages too
+	advise_huge_pages(start, start + ARENA_CHUNK_SIZE);
+
+	if (!pagemap_set_range(start, ARENA_CHUNK_SIZE, PAGE_ARENA)) {
+		munmap(start, ARENA_CHUNK_SIZE);
+		return 0;
+	}
+
+	struct arena_chunk *chunk = (struct arena_chunk *) start;
+	struct block_meta *block = (struct block_meta *)(start + CHUNK_HEADER_SIZE);
+
+	chunk->arena = arena;
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	__atomic_fetch_add(&arena_chunks, 1, __ATOMIC_RELAXED);
+
+	block->size = ARENA_CHUNK_SIZE - CHUNK_HEADER_SIZE - BLOCK_META_SIZE;
+	block->magic = BLOCK_MAGIC;
+	block->flags = BLOCK_ZEROED | BLOCK_RELEASED; // never touched
+	set_block_free(block);
+	insert_free_block(arena, block);
+	return 1;
+}
+
+// coalesce 2 blocks (it will be called for adjenct blocks), block1 keeps its status
+static void coalesce_blocks(struct block_meta *block1, struct block_meta *block2)
+{
+	set_block_size(block1, block_size(block1) + BLOCK_META_SIZE + block_size(block2));
+	// the absorbed header is part of the payload now
+	block1->flags = 0;
+	// the absorbed header is no longer a valid block
+	block2->magic = 0;
+	if (block2 == heap_last)
+		heap_last = block1;
+}
+
+// give back to the kernel the pages lying entirely inside [start, end)
+static void release_pages(char *start, char *end)
+{
+	unsigned long page_size = getpagesize();
+	char *first = (char *)(((unsigned long) start + page_size - 1) & ~(page_size - 1));
+	char *last = (char *)((unsigned long) end & ~(page_size - 1));
+
+	if (first < last)
+		madvise(first, last - first, MADV_DONTNEED);
+}
+
+// give back to the kernel the pages of a FREE block that may be resident, in [dirty_start, dirty_end)
+static void release_block(struct block_meta *block, char *dirty_start, char *dirty_end)
+{
+	// keep the links and the footer
+	char *payload = get_ptr_block(block);
+	char *start = payload + sizeof(struct tree_links);
+	char *end = payload + block_size(block) - FOOTER_SIZE;
+
+	release_pages(dirty_start > start ? dirty_start : start, dirty_end < end ? dirty_end : end);
+	block->flags |= BLOCK_RELEASED;
+}
+
+// merge a block that has just become FREE with its FREE physical neighbours,
+// found through the boundary tags, and return the resulting block marked FREE
+// neither block nor the result are in the free lists
+// a large result releases its pages, except the ones of neighbours already released
+static struct block_meta *coalesce_neighbours(struct arena *arena, struct block_meta *block)
+{
+	struct block_meta *next = next_heap_block(block);
+	struct block_meta *prev = prev_free_block(block);
+	// the pages of the result that may still be resident lie in [dirty_start, dirty_end)
+	char *dirty_start = get_ptr_block(block);
+	char *dirty_end = (block->flags & BLOCK_RELEASED) ? dirty_start : dirty_start + block_size(block);
+
+	if (next && block_status(next) == STATUS_FREE) {
+		// a released block still has its links resident
+		dirty_end = (char *) get_ptr_block(next) +
+					((next->flags & BLOCK_RELEASED) ? sizeof(struct tree_links) : block_size(next));
+		remove_free_block(arena, next);
+		coalesce_blocks(block, next);
+	}
+	if (prev) {
+		dirty_start = (prev->flags & BLOCK_RELEASED) ? (char *) block - FOOTER_SIZE : get_ptr_block(prev);
+		remove_free_block(arena, prev);
+		coalesce_blocks(prev, block);
+		block = prev;
+	}
+	set_block_free(block);
+
+	// the end of the sbrk heap is trimmed instead, the growth step it keeps stays resident
+	if (block_size(block) >= __atomic_load_n(&trim_threshold, __ATOMIC_RELAXED) &&
+		!(arena == main_arena && block == heap_last))
+		release_block(block, dirty_start, dirty_end);
+	return block;
+}
+
+// shrink the sbrk heap when it ends with a large FREE block, the main arena lock must be held
+static void trim_heap(struct block_meta *last)
+{
+	// don't break the huge pages of the heap
+	unsigned long page_size = (huge_pages() != THP_OFF) ? HUGE_PAGE_SIZE : (unsigned long) getpagesize();
+	// keep the header and a growth step, up to a page boundary, so the heap doesn't
+	// shrink and grow again on every free and malloc at its end
+	size_t keep = (heap_grow_size > MIN_PAYLOAD) ? heap_grow_size : MIN_PAYLOAD;
+	char *new_end = (char *)(((unsigned long) last + BLOCK_META_SIZE + keep + page_size - 1) &
+							 ~(page_size - 1));
+
+	if (block_size(last) < __atomic_load_n(&trim_threshold, __ATOMIC_RELAXED) ||
+		heap_end - new_end < (long) page_size)
+		return;
+	// the break moved under us, the memory after the heap is not ours, only its pages go back
+	if (sbrk(0) != heap_end || sbrk(new_end - heap_end) == ALLOCATION_FAILED) {
+		release_block(last, get_ptr_block(last), heap_end);
+		return;
+	}
+
+	heap_end = new_end;
+	set_block_size(last, new_end - (char *) last - BLOCK_META_SIZE);
+	last->flags = 0;
+	set_block_free(last);
+}
+
+// attempt to split the block if possible for better memory management
+// if a split can't be made, mark the memory as being allocated and used
+// size = payload + padding (alignment of 8 bytes), at least MIN_PAYLOAD
+static void split_block(struct arena *arena, struct block_meta *block, size_t size)
+{
+	size = heap_payload(size);
+	if (block_size(block) >= size + BLOCK_META_SIZE + MIN_PAYLOAD) {
+		struct block_meta *new_block = (struct block_meta *)((char *)block + BLOCK_META_SIZE + size);
+
+		// the block before the remainder is allocated
+		new_block->size = (block_size(block) - size - BLOCK_META_SIZE) | STATUS_FREE;
+		new_block->magic = BLOCK_MAGIC;
+		// the remainder was part of the payload, it is as clean as it was
+		new_block->flags = block->flags;
+
+		set_block_size(block, size);
+		set_block_status(block, STATUS_ALLOC);
+		if (block == heap_last)
+			heap_last = new_block;
+
+		// the remainder may border a FREE block when the block shrinks in place
+		new_block = coalesce_neighbours(arena, new_block);
+		if (arena == main_arena && new_block == heap_last)
+			trim_heap(new_block);
+		insert_free_block(arena, new_block);
+	} else {
+		set_block_used(block);
+	}
+}
+
+// return the best fitting block in memory if exists, otherwise NULL
+// only the bin of the requested size and the first non empty bin above it are searched
+static struct block_meta *find_best_free_block(struct arena *arena, size_t size)
+{
+	int index = bin_index(size);
+	struct block_meta *best = NULL;
+
+	// small bins hold a single size class
+	if (index < SMALL_BINS)
+		best = arena->free_bins[index];
+	else
+		best = tree_best_fit(arena, index, size);
+	if (best)
+		return best;
+
+	// every block of a higher bin is large enough
+	index = next_nonempty_bin(arena, index + 1);
+	if (index < 0)
+		return NULL;
+	return (index < SMALL_BINS) ? arena->free_bins[index] : tree_smallest(arena->free_bins[index]);
+}
+
+// last block of the sbrk heap if it is a FREE block, otherwise NULL
+static struct block_meta *find_last_free_block(void)
+{
+	if (heap_last && block_status(heap_last) == STATUS_FREE)
+		return heap_last;
+	return NULL;
+}
+
+// grow the last block of the heap in place with sbrk so that it can hold size bytes
+static struct block_meta *expand_last_block(struct block_meta *last, size_t size)
+{
+	size_t missing = heap_payload(size) - block_size(last);
+	// the new piece brings its own header, which becomes payload after the merge
+	struct block_meta *block = request_memory(missing > BLOCK_META_SIZE + MIN_PAYLOAD ?
+											  missing - BLOCK_META_SIZE : MIN_PAYLOAD, 0);
+
+	if (block == NULL)
+		return NULL;
+	coalesce_blocks(last, block);
+	return last;
+}
+
+// min on size_t type
+size_t min(size_t a, size_t b)
+{
+	return (a < b) ? a : b;
+}
+
+// allocate a block on the heap of an arena, the arena lock must be held
+// zeroed tells if the payload is known to be all zeros, NULL if the heap can't grow
+static struct block_meta *heap_alloc(struct arena *arena, size_t size, int *zeroed)
+{
+	struct block_meta *block = NULL;
+
+	if (arena == main_arena && !heap_preallocated) {
+		// without an sbrk heap the main arena grows with chunks like the others
+		if (!preallocate_heap())
+			heap_foreign_break = 1;
+		heap_preallocated = 1;
+	}
+
+	block = find_best_free_block(arena, heap_payload(size));
+	if (block) {
+		// found a memory block on the prealloacated heap
+		// try to split the block, otherwise the function will mark the zone as in use
+		remove_free_block(arena, block);
+		split_block(arena, block, size);
+	} else if (arena == main_arena && !heap_foreign_break) {
+		// try to expand the last free block
+		struct block_meta *last = find_last_free_block();
+
+		if (last == NULL) {
+			// there is no free block to expand
+			// request additional memory at the end of the heap
+			block = request_memory(size, 0);
+		} else {
+			// found a block to expand at the end of the heap
+			remove_free_block(arena, last);
+			block = expand_last_block(last, size);
+			if (block == NULL)
+				insert_free_block(arena, last);
+		}
+		if (block)
+			split_block(arena, block, size);
+		else if (!heap_foreign_break)
+			return NULL;
+	}
+
+	if (block == NULL) {
+		// the chunks of the arena are full, a new one fits any heap block
+		if (!add_arena_chunk(arena))
+			return NULL;
+		block = find_best_free_block(arena, heap_payload(size));
+		remove_free_block(arena, block);
+		split_block(arena, block, size);
+	}
+
+	*zeroed = block->flags & BLOCK_ZEROED;
+	if (*zeroed) {
+		// a clean FREE block still holds its links and footer
+		memset(get_ptr_block(block), 0, sizeof(struct free_links));
+		*(size_t *)((char *) get_ptr_block(block) + block_size(block) - FOOTER_SIZE) = 0;
+	}
+	block->flags = 0;
+	return block;
+}
+
+// mark a heap block as FREE and merge it with its neighbours, the arena lock must be held
+static void heap_free(struct arena *arena, struct block_meta *block)
+{
+	block->flags = 0;
+	block = coalesce_neighbours(arena, block);
+	if (arena == main_arena && block == heap_last)
+		trim_heap(block);
+	insert_free_block(arena, block);
+}
+
+// allocate a heap block with the payload aligned to alignment, the arena lock must be held
+// a large enough block is carved so that the slack before the aligned payload is a FREE block
+// the payload left after the slack is at least heap_payload(size), a small block still holds its footer
+static struct block_meta *heap_alloc_aligned(struct arena *arena, size_t alignment, size_t size, int *zeroed)
+{
+	struct block_meta *block = heap_alloc(arena, heap_payload(size) + alignment + BLOCK_META_SIZE + MIN_PAYLOAD,
+										  zeroed);
+
+	if (block == NULL)
+		return NULL;
+
+	char *payload = get_ptr_block(block);
+
+	if ((unsigned long) payload % alignment != 0) {
+		// the slack must hold a FREE block
+		char *aligned = (char *)(((unsigned long) payload + BLOCK_META_SIZE + MIN_PAYLOAD + alignment - 1) &
+								 ~(alignment - 1));
+		struct block_meta *lead = block;
+
+		block = get_block_ptr(aligned);
+		block->size = (block_size(lead) - (aligned - payload)) | STATUS_ALLOC;
+		block->magic = BLOCK_MAGIC;
+		block->flags = 0;
+		set_block_size(lead, (char *) block - payload);
+		if (lead == heap_last)
+			heap_last = block;
+		heap_free(arena, lead);
+	}
+	split_block(arena, block, size);
+	return block;
+}
+
+// resize a heap block without moving it, the arena lock must be held
+// a growing block absorbs its FREE physical successor, found right after its payload, and
+// grows the sbrk heap when it ends it, possibly both
+// return 0 if the block can't be resized in place
+static int heap_resize_in_place(struct arena *arena, struct block_meta *block, size_t size)
+{
+	struct block_meta *next = next_heap_block(block);
+	size_t old_size = block_size(block);
+	// past the mmap threshold the block moves to an mmap block, which can be remapped later
+	int top = arena == main_arena && size + BLOCK_META_SIZE < __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED);
+	// what is left after the block lies in the absorbed memory, as clean as it was
+	// fresh sbrk memory is zeroed and not resident yet
+	unsigned int clean = BLOCK_ZEROED | BLOCK_RELEASED;
+	int resized = 1;
+
+	if (old_size >= heap_payload(size)) {
+		// truncate the block and try to split it
+		split_block(arena, block, size);
+		return 1;
+	}
+
+	// like heap_alloc, the heap only grows when no FREE block can take the data instead
+	if (top && (next == heap_last || block == heap_last))
+		top = (find_best_free_block(arena, heap_payload(size)) == NULL);
+
+	// the successor is only absorbed if that is enough, or if the heap top can grow past it
+	if (next && block_status(next) == STATUS_FREE &&
+		(old_size + BLOCK_META_SIZE + block_size(next) >= heap_payload(size) || (top && next == heap_last))) {
+		clean &= next->flags;
+		remove_free_block(arena, next);
+		coalesce_blocks(block, next);
+	}
+
+	if (block_size(block) < heap_payload(size) &&
+		(!top || block != heap_last || expand_last_block(block, size) == NULL)) {
+		// give back what was absorbed, the block moves
+		size = old_size;
+		resized = 0;
+	}
+
+	// split the zone after to future reuse
+	block->flags = clean;
+	split_block(arena, block, size);
+	block->flags = 0;
+	return resized;
+}
+
+// arena of the current thread, assigned round robin on first use
+// in NUMA mode it is one of the arenas of the node the thread runs on
+static struct arena *thread_arena(void)
+{
+	if (tcache.arena)
+		return tcache.arena;
+
+	if (__atomic_load_n(&narenas, __ATOMIC_RELAXED) == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		int count = (cpus > 0) ? cpus * ARENAS_PER_CPU : 1;
+		int nodes = numa_nodes();
+
+		if (arena_limit)
+			count = arena_limit;
+
+		// every node gets an arena, the main arena has none
+		if (nodes && count < nodes + 1)
+			count = nodes + 1;
+		__atomic_store_n(&numa_count, nodes, __ATOMIC_RELAXED);
+		__atomic_store_n(&narenas, count < MAX_ARENAS ? count : MAX_ARENAS, __ATOMIC_RELAXED);
+	}
+
+	unsigned int ticket = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED);
+
+	if (numa_count) {
+		int node = current_node();
+		int node_arenas = (narenas - 1 - node + numa_count - 1) / numa_count;
+
+		tcache.arena = &arenas[1 + node + (ticket % node_arenas) * numa_count];
+	} else {
+		tcache.arena = &arenas[ticket % narenas];
+	}
+	return tcache.arena;
+}
+
+// slab of a small pointer
+static struct slab *slab_of(void *ptr)
+{
+	return (struct slab *)((unsigned long) ptr & ~(SLAB_SIZE - 1));
+}
+
+// size class of a small request
+static int slab_class(size_t size)
+{
+	return slab_class_index[(size + SLAB_CLASS_STEP - 1) / SLAB_CLASS_STEP];
+}
+
+// slot number of a pointer inside its slab, -1 if it doesn't point to a slot
+// the pages of a segment not handed out yet, or released, have no slab header: it is all zero
+static int slab_slot(struct slab *slab, void *ptr)
+{
+	unsigned long offset = (char *) ptr - (char *) slab;
+
+	if (slab->slot_size == 0 || slab->arena < &arenas[0] || slab->arena >= &arenas[MAX_ARENAS])
+		return -1;
+	if (offset < SLAB_HEADER_SIZE || (offset - SLAB_HEADER_SIZE) % slab->slot_size != 0)
+		return -1;
+	offset = (offset - SLAB_HEADER_SIZE) / slab->slot_size;
+	return (offset < slab->total) ? (int) offset : -1;
+}
+
+// link a slab in the list of its class, it has free slots again
+static void slab_link(struct arena *arena, struct slab *slab)
+{
+	struct slab **list = &arena->slabs[slab_class_index[slab->slot_size / SLAB_CLASS_STEP]];
+
+	slab->prev = NULL;
+	slab->next = *list;
+	if (*list)
+		(*list)->prev = slab;
+	*list = slab;
+}
+
+// unlink a slab from the list of its class
+static void slab_unlink(struct arena *arena, struct slab *slab)
+{
+	if (slab->prev)
+		slab->prev->next = slab->next;
+	else
+		arena->slabs[slab_class_index[slab->slot_size / SLAB_CLASS_STEP]] = slab->next;
+	if (slab->next)
+		slab->next->prev = slab->prev;
+}
+
+// take a page for a new slab of the given class, the arena lock must be held
+static struct slab *new_slab(struct arena *arena, int class)
+{
+	struct slab *slab = arena->empty_slabs;
+	struct slab_released *released = arena->released_slabs;
+
+	if (slab) {
+		arena->empty_slabs = slab->next;
+		arena->empty_count--;
+	} else if (released) {
+		// a released page faults back in zeroed, the page of addresses goes last
+		if (released->count > 0) {
+			slab = released->pages[--released->count];
+		} else {
+			arena->released_slabs = released->next;
+			slab = (struct slab *) released;
+		}
+	} else {
+		if (arena->slab_next == arena->slab_end) {
+			// slab pages are mapped in segments
+			char *segment = mmap(NULL, SLAB_SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+								 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+			if (segment == MAP_FAILED)
+				return NULL;
+			if (!pagemap_set_range(segment, SLAB_SEGMENT_SIZE, PAGE_SLAB)) {
+				munmap(segment, SLAB_SEGMENT_SIZE);
+				return NULL;
+			}
+			bind_to_node(arena, segment, SLAB_SEGMENT_SIZE);
+			__atomic_fetch_add(&slab_segments, 1, __ATOMIC_RELAXED);
+			arena->slab_next = segment;
+			arena->slab_end = segment + SLAB_SEGMENT_SIZE;
+		}
+		slab = (struct slab *) arena->slab_next;
+		arena->slab_next += SLAB_SIZE;
+	}
+
+	slab->arena = arena;
+	slab->slot_size = slab_class_size[class];
+	slab->total = (SLAB_SIZE - SLAB_HEADER_SIZE) / slab->slot_size;
+	slab->free_count = slab->total;
+	memset(slab->free_map, 0, sizeof(slab->free_map));
+	for (unsigned int i = 0; i < slab->total; i++)
+		slab->free_map[i / BITS_PER_LONG] |= 1UL << (i % BITS_PER_LONG);
+	slab_link(arena, slab);
+	return slab;
+}
+
+// pop a free slot of a small size class, the arena lock must be held
+static void *slab_alloc(struct arena *arena, size_t size)
+{
+	int class = slab_class(size);
+	struct slab *slab = arena->slabs[class];
+
+	if (slab == NULL) {
+		slab = new_slab(arena, class);
+		if (slab == NULL)
+			return NULL;
+	}
+
+	int word = 0;
+
+	while (slab->free_map[word] == 0)
+		word++;
+
+	int slot = word * BITS_PER_LONG + __builtin_ctzl(slab->free_map[word]);
+
+	slab->free_map[word] &= ~(1UL << (slot % BITS_PER_LONG));
+	if (--slab->free_count == 0)
+		slab_unlink(arena, slab);
+	return (char *) slab + SLAB_HEADER_SIZE + slot * slab->slot_size;
+}
+
+// keep an empty slab page for reuse, the arena lock must be held
+// past trim_threshold bytes of empty pages the arena gives its memory back, like a FREE heap block
+static void slab_put_empty(struct arena *arena, struct slab *slab)
+{
+	struct slab_released *released = arena->released_slabs;
+
+	if ((arena->empty_count + 1) * SLAB_SIZE <= __atomic_load_n(&trim_threshold, __ATOMIC_RELAXED)) {
+		slab->next = arena->empty_slabs;
+		arena->empty_slabs = slab;
+		arena->empty_count++;
+		return;
+	}
+	if (released == NULL || released->count == SLAB_RELEASED_PER_PAGE) {
+		// the page stays resident to hold the next released addresses
+		released = (struct slab_released *) slab;
+		released->next = arena->released_slabs;
+		released->count = 0;
+		arena->released_slabs = released;
+		return;
+	}
+	madvise(slab, SLAB_SIZE, MADV_DONTNEED);
+	released->pages[released->count++] = slab;
+}
+
+// give a slot back to its slab, double frees are ignored, the arena lock must be held
+static void slab_free(struct slab *slab, void *ptr)
+{
+	struct arena *arena = slab->arena;
+	int slot = slab_slot(slab, ptr);
+	unsigned long bit = 1UL << (slot % BITS_PER_LONG);
+
+	if (slot < 0 || (slab->free_map[slot / BITS_PER_LONG] & bit))
+		return;
+	slab->free_map[slot / BITS_PER_LONG] |= bit;
+	if (++slab->free_count == 1)
+		slab_link(arena, slab);
+	if (slab->free_count == slab->total) {
+		// the page can be reused by any size class
+		slab_unlink(arena, slab);
+		slab_put_empty(arena, slab);
+	}
+}
+
+// arena owning a slab pointer or a heap block
+static struct arena *backend_arena(void *ptr)
+{
+	if (pagemap_get(ptr) == PAGE_SLAB)
+		return slab_of(ptr)->arena;
+	return arena_of(get_block_ptr(ptr));
+}
+
+// return a pointer to its slab or heap, the lock of its arena must be held
+static void backend_free_locked(struct arena *arena, void *ptr)
+{
+	if (pagemap_get(ptr) == PAGE_SLAB) {
+		slab_free(slab_of(ptr), ptr);
+	} else {
+		struct block_meta *block = get_block_ptr(ptr);
+
+		// another thread may have freed the same pointer in the meantime
+		if (block_status(block) == STATUS_ALLOC)
+			heap_free(arena, block);
+	}
+}
+
+// free the pointers pushed on the remote list of an arena, its lock must be held
+static void drain_remote_frees(struct arena *arena)
+{
+	if (__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) == NULL)
+		return;
+
+	struct tcache_entry *entry = __atomic_exchange_n(&arena->remote_frees, NULL, __ATOMIC_ACQUIRE);
+
+	while (entry) {
+		struct tcache_entry *next = entry->next;
+
+		entry->key = 0;
+		backend_free_locked(arena, entry);
+		entry = next;
+	}
+}
+
+// push a pointer on the remote list of its arena, lock free: any thread may push
+// while the holder of the lock drains the list
+// return 0 if it may be queued already, it has to take the lock then
+static int remote_push(struct arena *arena, void *ptr)
+{
+	struct tcache_entry *entry = ptr;
+
+	if (entry->key == REMOTE_ENTRY_KEY)
+		return 0;
+	entry->key = REMOTE_ENTRY_KEY;
+	entry->next = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&arena->remote_frees, &entry->next, entry, 1,
+										__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	return 1;
+}
+
+// return a pointer that is not cached to the slab or the arena owning it
+// the arena of another thread gets it on its remote list, so the free never waits for it
+static void backend_free(void *ptr)
+{
+	struct arena *arena = backend_arena(ptr);
+
+	if (arena != tcache.arena && remote_push(arena, ptr))
+		return;
+
+	mmap_cache_expire();
+	pthread_mutex_lock(&arena->lock);
+	drain_remote_frees(arena);
+	backend_free_locked(arena, ptr);
+	pthread_mutex_unlock(&arena->lock);
+}
+
+// return pointers that are not cached to their arenas, taking every arena lock once
+// they are sorted by arena and address, so neighbours are coalesced one after the other
+static void backend_free_batch(void **ptrs, size_t count)
+{
+	struct arena *owners[FREE_BATCH];
+
+	for (size_t i = 0; i < count; i++) {
+		void *ptr = ptrs[i];
+		struct arena *owner = backend_arena(ptr);
+		size_t j = i;
+
+		for (; j > 0 && (owners[j - 1] > owner || (owners[j - 1] == owner && ptrs[j - 1] > ptr)); j--) {
+			owners[j] = owners[j - 1];
+			ptrs[j] = ptrs[j - 1];
+		}
+		owners[j] = owner;
+		ptrs[j] = ptr;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		if (i == 0 || owners[i] != owners[i - 1]) {
+			pthread_mutex_lock(&owners[i]->lock);
+			drain_remote_frees(owners[i]);
+		}
+		backend_free_locked(owners[i], ptrs[i]);
+		if (i == count - 1 || owners[i] != owners[i + 1])
+			pthread_mutex_unlock(&owners[i]->lock);
+	}
+}
+
+// resize an mmap block with mremap, the kernel moves the pages instead of copying them
+// return NULL if the block was left unchanged
+static struct block_meta *remap_block(struct block_meta *block, size_t size)
+{
+	struct mapped_block *map = mapped_of(block);
+	size_t old_len = map->length;
+
+	size = mapped_payload(size);
+	size_t new_len = MAPPED_HEADER_SIZE + size;
+
+	// the mapping already has the right number of pages
+	if (map->offset == 0 && old_len == new_len && !(block->flags & BLOCK_GUARDED))
+		return block;
+	// huge pages from the pool are not moved around, aligned blocks would lose their alignment
+	// and guarded blocks their guard page
+	if ((block->flags & (BLOCK_HUGETLB | BLOCK_GUARDED)) || map->offset != 0)
+		return NULL;
+
+	// the header may move, take it out of the list while remapping
+	pthread_mutex_lock(&mapped_lock);
+	remove_mapped_block(map);
+	pagemap_set(map, PAGE_NONE);
+	pthread_mutex_unlock(&mapped_lock);
+
+	struct mapped_block *new_map = mremap(map, old_len, new_len, MREMAP_MAYMOVE);
+
+	if (new_map == MAP_FAILED) {
+		new_map = map;
+	} else {
+		new_map->length = new_len;
+		new_map->meta.flags |= BLOCK_RESIZED;
+		set_block_size(&new_map->meta, size);
+	}
+
+	pthread_mutex_lock(&mapped_lock);
+	add_mapped_block(new_map);
+	// the old pages are gone already, a moved block that can't be registered can't be handed back
+	DIE(!pagemap_set(new_map, PAGE_MAPPED), "Error mapping page map leaf");
+	pthread_mutex_unlock(&mapped_lock);
+
+	return (block_size(&new_map->meta) == size) ? &new_map->meta : NULL;
+}
+
+// bin of the thread cache serving requests of size bytes
+static int tcache_index(size_t size)
+{
+	return (ALIGN(size) - 1) / TCACHE_BIN_STEP;
+}
+
+// return every cached pointer of the exiting thread to the backend
+static void tcache_flush(void *arg)
+{
+	struct thread_cache *cache = arg;
+
+#ifdef OSMEM_DEBUG
+	// the quarantined blocks were counted as freed already
+	while (cache->quarantine_count > 0)
+		backend_free(quarantine_pop(cache));
+#endif
+	for (int i = 0; i < TCACHE_BINS; i++) {
+		while (cache->bins[i]) {
+			struct tcache_entry *entry = cache->bins[i];
+
+			cache->bins[i] = entry->next;
+			entry->key = 0;
+			backend_free(entry);
+		}
+		cache->counts[i] = 0;
+	}
+	backend_free_batch(cache->remote, cache->remote_count);
+	cache->remote_count = 0;
+
+	// the counters of the thread outlive it
+	pthread_mutex_lock(&stats_lock);
+	if (cache->prev)
+		cache->prev->next = cache->next;
+	else
+		threads = cache->next;
+	if (cache->next)
+		cache->next->prev = cache->prev;
+	for (int i = STAT_ALLOC; i <= STAT_FREE; i++) {
+		__atomic_fetch_add(&exited_stats.calls[i], cache->stats.calls[i], __ATOMIC_RELAXED);
+		__atomic_fetch_add(&exited_stats.bytes[i], cache->stats.bytes[i], __ATOMIC_RELAXED);
+	}
+	cache->disabled = 1;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static void stats_signal_handler(int signo)
+{
+	(void) signo;
+	os_malloc_stats_print(STDERR_FILENO);
+}
+
+static void tcache_create_key(void)
+{
+	DIE(pthread_key_create(&tcache_key, tcache_flush) != 0, "Error creating thread cache key");
+	// any value unlikely to show up in user data does
+	tcache_entry_key = ((unsigned long) &tcache_entry_key ^ (unsigned long) getpid()) * 0x9e3779b97f4a7c15UL;
+
+	// OSMEM_STATS_SIGNAL=<signal number> dumps the statistics on that signal
+	const char *env = getenv("OSMEM_STATS_SIGNAL");
+
+	if (env && atoi(env) > 0) {
+		struct sigaction action = { .sa_handler = stats_signal_handler, .sa_flags = SA_RESTART };
+
+		sigemptyset(&action.sa_mask);
+		sigaction(atoi(env), &action, NULL);
+	}
+}
+
+// register the thread on its first call: the key destructor flushes its cache
+// when it exits and its counters are linked in the list of threads
+static void thread_register(void)
+{
+	tcache.registered = 1;
+	pthread_once(&tcache_once, tcache_create_key);
+	pthread_setspecific(tcache_key, &tcache);
+
+	pthread_mutex_lock(&stats_lock);
+	tcache.prev = NULL;
+	tcache.next = threads;
+	if (threads)
+		threads->prev = &tcache;
+	threads = &tcache;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+// count calls and usable bytes allocated or freed (kind) by the current thread
+static void stats_add(int kind, size_t calls, size_t bytes)
+{
+	if (!tcache.registered)
+		thread_register();
+	if (tcache.disabled) {
+		// the thread is exiting, its counters were already summed up
+		__atomic_fetch_add(&exited_stats.calls[kind], calls, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&exited_stats.bytes[kind], bytes, __ATOMIC_RELAXED);
+		return;
+	}
+	__atomic_store_n(&tcache.stats.calls[kind], tcache.stats.calls[kind] + calls, __ATOMIC_RELAXED);
+	__atomic_store_n(&tcache.stats.bytes[kind], tcache.stats.bytes[kind] + bytes, __ATOMIC_RELAXED);
+}
+
+// usable bytes of a block resized in place changed from old_size to new_size
+static void stats_resize(size_t old_size, size_t new_size)
+{
+	stats_add(STAT_FREE, 0, old_size);
+	stats_add(STAT_ALLOC, 0, new_size);
+}
+
+// mean bytes between two samples of the heap profiler, 0 when it is off
+static long profile_interval(void)
+{
+	long rate = __atomic_load_n(&profile_rate, __ATOMIC_RELAXED);
+
+	if (rate < 0) {
+		const char *env = getenv("OSMEM_PROFILE");
+		void *frame;
+
+		rate = env ? strtol(env, NULL, 10) : 0;
+		if (rate < 0)
+			rate = 0;
+		__atomic_store_n(&profile_rate, rate, __ATOMIC_RELAXED);
+		// backtrace loads the unwinder and allocates on its first call, the allocations
+		// of the unwinder find the rate set and are not sampled
+		if (rate > 0) {
+			tcache.sampling = 1;
+			backtrace(&frame, 1);
+			tcache.sampling = 0;
+		}
+	}
+	return rate;
+}
+
+// the byte countdown of the thread ran out, draw the next one
+// the gaps are exponential with a mean of profile_rate, so every byte has the same chance to be sampled
+// return 1 if the current allocation is sampled
+static int profile_next_sample(void)
+{
+	long rate = profile_interval();
+	int first = (tcache.sample_seed == 0);
+	unsigned long seed = tcache.sample_seed;
+
+	if (rate == 0) {
+		tcache.sample_left = LONG_MAX;
+		return 0;
+	}
+	if (first)
+		seed = ((unsigned long) &tcache * 0x9e3779b97f4a7c15UL) | 1;
+
+	// xorshift64*, the top 53 bits make a uniform double in (0, 1]
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	tcache.sample_seed = seed;
+
+	double u = (double)(((seed * 0x2545f4914f6cdd1dUL) >> 11) + 1) / (double)(1UL << 53);
+
+	tcache.sample_left = (long)(-log(u) * rate);
+	// the countdown of a new thread starts here
+	return !first && !tcache.sampling;
+}
+
+// find the site of a call stack or add it while the table isn't too full, profile_lock must be held
+static struct profile_site *profile_site(void **stack, int depth, unsigned long hash)
+{
+	if (profile_sites == NULL) {
+		void *table = mmap(NULL, PROFILE_SITES * sizeof(struct profile_site), PROT_READ | PROT_WRITE,
+						   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (table == MAP_FAILED)
+			return NULL;
+		profile_sites = table;
+	}
+
+	for (size_t i = hash % PROFILE_SITES; ; i = (i + 1) % PROFILE_SITES) {
+		struct profile_site *site = &profile_sites[i];
+
+		if (site->depth == 0) {
+			if (profile_site_count >= PROFILE_SITES / 4 * 3)
+				return NULL;
+			memcpy(site->stack, stack, depth * sizeof(void *));
+			site->depth = depth;
+			site->hash = hash;
+			profile_site_count++;
+			return site;
+		}
+		if (site->hash == hash && site->depth == depth && memcmp(site->stack, stack, depth * sizeof(void *)) == 0)
+			return site;
+	}
+}
+
+// account a sampled block to the call stack allocating it, no allocator lock may be held
+static __attribute__((noinline)) void profile_record(struct block_meta *block)
+{
+	void *stack[PROFILE_SKIP + PROFILE_DEPTH];
+	unsigned long hash = 0xcbf29ce484222325UL;
+	int depth;
+
+	tcache.sampling = 1;
+	depth = backtrace(stack, PROFILE_SKIP + PROFILE_DEPTH) - PROFILE_SKIP;
+	tcache.sampling = 0;
+	if (depth <= 0)
+		return;
+
+	for (int i = 0; i < depth; i++)
+		hash = (hash ^ (unsigned long) stack[PROFILE_SKIP + i]) * 0x100000001b3UL;
+
+	pthread_mutex_lock(&profile_lock);
+	struct profile_site *site = profile_site(stack + PROFILE_SKIP, depth, hash);
+
+	if (site) {
+		site->live_count++;
+		site->live_bytes += block_size(block);
+		site->total_count++;
+		site->total_bytes += block_size(block);
+		block->flags |= BLOCK_SAMPLED | (unsigned int)(site - profile_sites) << PROFILE_SITE_SHIFT;
+	}
+	pthread_mutex_unlock(&profile_lock);
+}
+
+// a sampled block is freed, its bytes are no longer in use at its call site
+static void profile_release(struct block_meta *block)
+{
+	struct profile_site *site = &profile_sites[block->flags >> PROFILE_SITE_SHIFT];
+
+	pthread_mutex_lock(&profile_lock);
+	site->live_count--;
+	site->live_bytes -= block_size(block);
+	pthread_mutex_unlock(&profile_lock);
+	block->flags &= ((1U << PROFILE_SITE_SHIFT) - 1) & ~BLOCK_SAMPLED;
+}
+
+// queue a freed pointer of an arena bound to another node than the one of the thread,
+// the queue goes back to the owning arenas in one batch once full
+// return 0 if the pointer is local
+static int remote_free(void *ptr)
+{
+	struct arena *owner = backend_arena(ptr);
+
+	if (owner == main_arena || arena_node(owner) == arena_node(thread_arena()))
+		return 0;
+
+	if (!tcache.registered)
+		thread_register();
+	tcache.remote[tcache.remote_count++] = ptr;
+	if (tcache.remote_count == FREE_BATCH) {
+		backend_free_batch(tcache.remote, FREE_BATCH);
+		tcache.remote_count = 0;
+	}
+	return 1;
+}
+
+// try to keep a freed pointer with usable bytes in the thread cache
+// return 0 if it must go to the backend
+static int tcache_put(void *ptr, size_t usable)
+{
+	// a bin only holds pointers large enough for every request it serves
+	int index = usable / TCACHE_BIN_STEP - 1;
+	struct tcache_entry *entry = ptr;
+
+	if (tcache.disabled)
+		return 0;
+	// memory of another node is not reused here, it goes back to its own node
+	if (__atomic_load_n(&numa_count, __ATOMIC_RELAXED) && remote_free(ptr))
+		return 1;
+	if (index < 0 || index >= TCACHE_BINS)
+		return 0;
+
+	if (!tcache.registered)
+		thread_register();
+
+	// it may be on a remote list, the backend checks that under the lock
+	if (entry->key == REMOTE_ENTRY_KEY)
+		return 0;
+	if (entry->key == tcache_entry_key) {
+		// most likely a double free, the key might also be user data
+		for (struct tcache_entry *current = tcache.bins[index]; current; current = current->next)
+			if (current == entry)
+				return 1;
+	}
+	if (tcache.counts[index] >= TCACHE_COUNT)
+		return 0;
+
+	entry->key = tcache_entry_key;
+	entry->next = tcache.bins[index];
+	tcache.bins[index] = entry;
+	tcache.counts[index]++;
+	return 1;
+}
+
+// pop a cached pointer for a request of 1 to TCACHE_MAX_SIZE bytes, NULL on a miss
+static void *tcache_get(size_t size)
+{
+	int index = tcache_index(size);
+	struct tcache_entry *entry = tcache.bins[index];
+
+	if (entry == NULL)
+		return NULL;
+	tcache.bins[index] = entry->next;
+	tcache.counts[index]--;
+	entry->next = NULL;
+	entry->key = 0;
+	return entry;
+}
+
+#ifdef OSMEM_DEBUG
+// set the canaries of a new block for size requested bytes, it has room for the tail one
+static void *debug_alloc(void *ptr, size_t size)
+{
+	struct block_meta *block;
+	unsigned long tail[2];
+
+	if (ptr == NULL)
+		return NULL;
+	block = get_block_ptr(ptr);
+	block->canary = debug_canary(block);
+	block->requested = size;
+	tail[0] = tail[1] = block->canary;
+	memcpy((char *) ptr + size, tail, DEBUG_TAIL_SIZE);
+	return ptr;
+}
+
+// check a freed pointer and poison it in the quarantine, the blocks pushed out of it are freed
+// return the pointer if it is freed right away: mmap blocks, large or sampled blocks
+// and the blocks of an exiting thread
+static void *debug_free(void *ptr)
+{
+	struct block_meta *block;
+
+	if (ptr == NULL)
+		return NULL;
+	debug_check(ptr);
+	block = get_block_ptr(ptr);
+	if (block_status(block) == STATUS_MAPPED || block_size(block) > QUARANTINE_MAX_BLOCK ||
+		(block->flags & BLOCK_SAMPLED) || tcache.disabled)
+		return ptr;
+
+	// the block counts as freed, it is only held back from reuse
+	stats_add(STAT_FREE, 1, block_size(block));
+	memset(ptr, DEBUG_POISON, min(block->requested, DEBUG_POISON_SIZE));
+	block->flags |= BLOCK_QUARANTINED;
+	while (tcache.quarantine_count == QUARANTINE_ENTRIES ||
+		   (tcache.quarantine_count > 0 && tcache.quarantine_bytes + block_size(block) > QUARANTINE_SIZE)) {
+		void *old = quarantine_pop(&tcache);
+
+		if (!tcache_put(old, block_size(get_block_ptr(old))))
+			backend_free(old);
+	}
+	tcache.quarantine[(tcache.quarantine_head + tcache.quarantine_count) % QUARANTINE_ENTRIES] = ptr;
+	tcache.quarantine_count++;
+	tcache.quarantine_bytes += block_size(block);
+	return NULL;
+}
+#else
+static inline void *debug_alloc(void *ptr, size_t size)
+{
+	(void) size;
+	return ptr;
+}
+
+static inline void *debug_free(void *ptr)
+{
+	return ptr;
+}
+
+static inline void debug_check(void *ptr)
+{
+	(void) ptr;
+}
+#endif
+
+// set a parameter of os_mallopt, return 0 if the value is rejected
+static int set_option(int param, int value)
+{
+	struct arena *arena = main_arena;
+	int done = 1;
+
+	switch (param) {
+	case OS_M_ARENA_MAX:
+		// the threads are not moved once they have an arena
+		if (value < 1 || value > MAX_ARENAS || __atomic_load_n(&narenas, __ATOMIC_RELAXED) != 0)
+			return 0;
+		__atomic_store_n(&arena_limit, value, __ATOMIC_RELAXED);
+		break;
+	case OS_M_MMAP_THRESHOLD:
+		// larger heap blocks wouldn't fit in an arena chunk
+		if (value < 0 || value > MAP_THRESHOLD_MAX)
+			return 0;
+		__atomic_store_n(&mmap_threshold, value, __ATOMIC_RELAXED);
+		__atomic_store_n(&mmap_threshold_fixed, 1, __ATOMIC_RELAXED);
+		break;
+	case OS_M_TRIM_THRESHOLD:
+		if (value < 0)
+			return 0;
+		__atomic_store_n(&trim_threshold, value, __ATOMIC_RELAXED);
+		__atomic_store_n(&trim_threshold_fixed, 1, __ATOMIC_RELAXED);
+		break;
+	case OS_M_PREALLOC:
+	case OS_M_GROW:
+		if (value < 0)
+			return 0;
+		pthread_mutex_lock(&arena->lock);
+		if (param == OS_M_GROW)
+			heap_grow_size = ALIGN((size_t) value);
+		else if (!heap_preallocated && ALIGN((size_t) value) >= BLOCK_META_SIZE + heap_payload(0))
+			prealloc_size = ALIGN((size_t) value);
+		else
+			done = 0; // too small, or the heap is there already
+		pthread_mutex_unlock(&arena->lock);
+		break;
+	case OS_M_MMAP_CACHE:
+		// the cached mappings over the new size go on the next release
+		if (value < 0)
+			return 0;
+		__atomic_store_n(&mmap_cache_size, value, __ATOMIC_RELAXED);
+		break;
+	case OS_M_THP:
+		if (value < THP_OFF || value > THP_HUGETLB)
+			return 0;
+		__atomic_store_n(&thp_mode, value, __ATOMIC_RELAXED);
+		break;
+	case OS_M_PROFILE:
+		if (value < 0)
+			return 0;
+		// the environment is read first so it doesn't override the call later
+		profile_interval();
+		__atomic_store_n(&profile_rate, value, __ATOMIC_RELAXED);
+		if (value > 0) {
+			void *frame;
+
+			tcache.sampling = 1;
+			backtrace(&frame, 1);
+			tcache.sampling = 0;
+		}
+		break;
+	case OS_M_STATS:
+		__atomic_store_n(&stats_at_exit_enabled, value != 0, __ATOMIC_RELAXED);
+		break;
+	default:
+		return 0;
+	}
+	return done;
+}
+
+// take every lock of the allocator before a fork, so the child doesn't inherit one held
+// by a thread that doesn't exist there
+static void fork_prepare(void)
+{
+	pthread_mutex_lock(&profile_lock);
+	pthread_mutex_lock(&stats_lock);
+	pthread_mutex_lock(&mapped_lock);
+	for (int i = 0; i < MAX_ARENAS; i++)
+		pthread_mutex_lock(&arenas[i].lock);
+}
+
+// release the locks taken by fork_prepare, in the parent and in the child
+static void fork_release(void)
+{
+	for (int i = MAX_ARENAS - 1; i >= 0; i--)
+		pthread_mutex_unlock(&arenas[i].lock);
+	pthread_mutex_unlock(&mapped_lock);
+	pthread_mutex_unlock(&stats_lock);
+	pthread_mutex_unlock(&profile_lock);
+}
+
+// value of an OSMEM_* environment variable holding a number, 0 if it isn't set
+// return 1 if it is set
+static int env_value(const char *name, long *value)
+{
+	const char *env = getenv(name);
+
+	if (env == NULL || *env == '\0')
+		return 0;
+	*value = strtol(env, NULL, 10);
+	return 1;
+}
+
+// read the OSMEM_* environment variables, they are checked like the os_mallopt calls
+// OSMEM_THP, OSMEM_NUMA and OSMEM_PROFILE are read where they are used, OSMEM_GUARD by the debug build
+static void read_config(void)
+{
+	static const struct {
+		const char *name;
+		int param;
+	} options[] = {
+		{ "OSMEM_ARENAS", OS_M_ARENA_MAX },
+		{ "OSMEM_MMAP_THRESHOLD", OS_M_MMAP_THRESHOLD },
+		{ "OSMEM_TRIM_THRESHOLD", OS_M_TRIM_THRESHOLD },
+		{ "OSMEM_PREALLOC", OS_M_PREALLOC },
+		{ "OSMEM_GROW", OS_M_GROW },
+		{ "OSMEM_MMAP_CACHE", OS_M_MMAP_CACHE },
+		{ "OSMEM_STATS", OS_M_STATS },
+	};
+	long value;
+
+	for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); i++)
+		if (env_value(options[i].name, &value) && value <= INT_MAX)
+			set_option(options[i].param, value);
+#ifdef OSMEM_DEBUG
+	debug_secret = ((unsigned long) &debug_secret ^ (unsigned long) getpid() ^ cache_clock()) | 1;
+	debug_guard = env_value("OSMEM_GUARD", &value) && value > 0;
+	memset(debug_poison, DEBUG_POISON, sizeof(debug_poison));
+#endif
+	__atomic_store_n(&configured, 1, __ATOMIC_RELEASE);
+	// the C library may allocate to register the handlers, which must not wait for config_once
+	pthread_atfork(fork_prepare, fork_release, fork_release);
+}
+
+// read the configuration once, on the first allocation
+static inline void config_init(void)
+{
+	if (!__atomic_load_n(&configured, __ATOMIC_ACQUIRE))
+		pthread_once(&config_once, read_config);
+}
+
+// allocation entry point shared by os_malloc and os_calloc, the policy comes with the call:
+// - requests of at least threshold bytes (header included) are mapped with mmap
+// - with zero set the memory is cleared, unless it is known to be all zeros already
+// - out of slab pages or heap memory the request goes to the next way, NULL once mmap fails too
+static void *alloc_memory(size_t size, size_t threshold, int zero)
+{
+	size_t total_size = ALIGN(size) + BLOCK_META_SIZE;
+	struct block_meta *block = NULL;
+
+	void *ptr = NULL;
+	int zeroed = 0;
+	size_t usable = 0;
+
+	// the profiler costs a decrement until the countdown runs out,
+	// sampled blocks need a header to keep their call site
+	int sampled = (tcache.sample_left -= size) < 0 && profile_next_sample();
+
+	// tested before rounding, ALIGN would wrap a size near SIZE_MAX to bin -1
+	if (size <= TCACHE_MAX_SIZE && !sampled) {
+		ptr = tcache_get(size);
+		// every pointer of a bin has the same usable size
+		usable = (tcache_index(size) + 1) * TCACHE_BIN_STEP;
+	}
+
+	if (ptr == NULL && size <= SLAB_MAX_SIZE && !sampled && !DEBUG_BUILD) {
+		struct arena *arena = thread_arena();
+
+		pthread_mutex_lock(&arena->lock);
+		drain_remote_frees(arena);
+		ptr = slab_alloc(arena, size);
+		pthread_mutex_unlock(&arena->lock);
+		if (ptr)
+			usable = slab_class_size[slab_class(size)];
+	}
+
+	if (ptr == NULL && total_size < threshold) {
+		struct arena *arena = thread_arena();
+
+		mmap_cache_expire();
+		pthread_mutex_lock(&arena->lock);
+		drain_remote_frees(arena);
+		block = heap_alloc(arena, size, &zeroed);
+		pthread_mutex_unlock(&arena->lock);
+		if (block) {
+			ptr = get_ptr_block(block);
+			usable = block_size(block);
+		}
+	}
+	if (ptr == NULL) {
+		// request additional memory and add it in the list of mapped blocks
+		// a cached mapping serves os_calloc too: clearing the pages it already has
+		// costs less than faulting fresh zeroed pages in
+		block = mmap_cache_get(size);
+		if (block == NULL)
+			block = request_memory(size, 1);
+		if (block == NULL)
+			return NULL; // allocation failed.
+		zeroed = block->flags & BLOCK_ZEROED;
+		block->flags &= ~BLOCK_ZEROED;
+		pthread_mutex_lock(&mapped_lock);
+		add_mapped_block(mapped_of(block));
+		pthread_mutex_unlock(&mapped_lock);
+		ptr = get_ptr_block(block);
+		usable = block_size(block);
+	}
+	stats_add(STAT_ALLOC, 1, usable);
+	if (sampled)
+		profile_record(block);
+
+	// fresh mmap and sbrk pages were zeroed by the kernel, don't touch them
+	if (zero && !zeroed)
+		memset(ptr, 0, size);
+	return ptr;
+}
+
+// allocation entry point of the aligned allocations, alignment is a power of two
+static void *alloc_aligned(size_t alignment, size_t size)
+{
+	struct block_meta *block = NULL;
+	size_t total_size;
+	int zeroed;
+
+	config_init();
+	if (alignment <= ALIGNMENT)
+		return alloc_memory(size, __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED), 0);
+
+	if (__builtin_add_overflow(ALIGN(size), alignment + 2 * BLOCK_META_SIZE + MIN_PAYLOAD, &total_size) ||
+		total_size > MAX_REQUEST_SIZE)
+		return NULL;
+
+	if (total_size < __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+		struct arena *arena = thread_arena();
+
+		pthread_mutex_lock(&arena->lock);
+		drain_remote_frees(arena);
+		block = heap_alloc_aligned(arena, alignment, size, &zeroed);
+		pthread_mutex_unlock(&arena->lock);
+	}
+	if (block == NULL) {
+		// large or out of heap memory
+		block = map_block(size, alignment);
+		if (block == NULL)
+			return NULL;
+		block->flags &= ~BLOCK_ZEROED;
+		pthread_mutex_lock(&mapped_lock);
+		add_mapped_block(mapped_of(block));
+		pthread_mutex_unlock(&mapped_lock);
+	}
+	stats_add(STAT_ALLOC, 1, block_size(block));
+	return get_ptr_block(block);
+}
+
+// raise the mmap threshold up to the size of a freed mmap block
+static void update_mmap_threshold(size_t size)
+{
+	size_t total_size = size + BLOCK_META_SIZE;
+
+	if (__atomic_load_n(&mmap_threshold_fixed, __ATOMIC_RELAXED))
+		return;
+	// a new request of the same size stays below it and goes to the heap
+	if (total_size > __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED) && total_size <= MAP_THRESHOLD_MAX) {
+		__atomic_store_n(&mmap_threshold, total_size + 1, __ATOMIC_RELAXED);
+		if (!__atomic_load_n(&trim_threshold_fixed, __ATOMIC_RELAXED))
+			__atomic_store_n(&trim_threshold, 2 * (total_size + 1), __ATOMIC_RELAXED);
+	}
+}
+
+// release a pointer into the thread cache, or unmap it if it is an mmap block
+// return 1 if it must go to the backend, invalid pointers are ignored
+static int free_to_cache(void *ptr)
+{
+	// small pointers have no header, their slab tells the size
+	if (pagemap_get(ptr) == PAGE_SLAB) {
+		struct slab *slab = slab_of(ptr);
+
+		if (slab_slot(slab, ptr) < 0)
+			return 0;
+		stats_add(STAT_FREE, 1, slab->slot_size);
+		return !tcache_put(ptr, slab->slot_size);
+	}
+
+	struct block_meta *block = get_block_ptr(ptr);
+
+	if (!is_block_in_memory(block))
+		return 0;
+	if (block->flags & BLOCK_SAMPLED)
+		profile_release(block);
+	if (block_status(block) == STATUS_ALLOC) {
+		// the block goes back to the arena that owns it
+		stats_add(STAT_FREE, 1, block_size(block));
+		return !tcache_put(ptr, block_size(block));
+	} else if (block_status(block) == STATUS_MAPPED) {
+		struct mapped_block *map = mapped_of(block);
+
+		size_t size = block_size(block);
+
+		stats_add(STAT_FREE, 1, size);
+		pthread_mutex_lock(&mapped_lock);
+		remove_mapped_block(map);
+		pagemap_set(map, PAGE_NONE);
+		pthread_mutex_unlock(&mapped_lock);
+		// a cached mapping serves the next request of its size, the others move to the heap
+		if (!mmap_cache_put(map))
+			update_mmap_threshold(size);
+	}
+	return 0;
+}
+
+// resize the block of ptr in place when it can, or move it, for os_realloc
+static void *resize_memory(void *ptr, size_t size)
+{
+	struct block_meta *block = get_block_ptr(ptr);
+	void *new_ptr = NULL;
+
+	if (pagemap_get(ptr) == PAGE_SLAB) {
+		struct slab *slab = slab_of(ptr);
+
+		if (slab_slot(slab, ptr) < 0)
+			return NULL;
+		// stay in the slot while the size class doesn't change
+		if (size <= slab->slot_size &&
+			slab_class_size[slab_class(size)] == slab->slot_size)
+			return ptr;
+
+		new_ptr = os_malloc(size);
+		if (new_ptr == NULL)
+			return NULL;
+		memcpy(new_ptr, ptr, min(slab->slot_size, size));
+		os_free(ptr);
+		return new_ptr;
+	}
+
+	if (!is_block_in_memory(block) ||
+		(block_status(block) != STATUS_ALLOC && block_status(block) != STATUS_MAPPED))
+		return NULL;
+
+	size = ALIGN(size);
+	// do nothing if size didn't change
+	if (block_size(block) == size)
+		return ptr;
+
+	// a sampled block moves, its call site keeps the size it was sampled with
+	int in_place = !(block->flags & BLOCK_SAMPLED);
+
+	// on heap realloc try to keep the data in place first
+	if (block_status(block) == STATUS_ALLOC && in_place) {
+		struct arena *arena = arena_of(block);
+		size_t old_size = block_size(block);
+
+		pthread_mutex_lock(&arena->lock);
+		int resized = heap_resize_in_place(arena, block, size);
+		size_t new_size = block_size(block);
+
+		pthread_mutex_unlock(&arena->lock);
+		if (resized) {
+			stats_resize(old_size, new_size);
+			return ptr;
+		}
+	}
+
+	// large blocks keep their pages, only the changed ones are mapped or unmapped
+	if (block_status(block) == STATUS_MAPPED && in_place &&
+		size + BLOCK_META_SIZE >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+		size_t old_size = block_size(block);
+		struct block_meta *resized = remap_block(block, size);
+
+		if (resized) {
+			stats_resize(old_size, block_size(resized));
+			return get_ptr_block(resized);
+		}
+	}
+
+	// could not resize the block, move it to a new place
+	new_ptr = os_malloc(size);
+	if (new_ptr == NULL)
+		return NULL;
+	memmove(new_ptr, get_ptr_block(block), min(block_size(block), size));
+	os_free(get_ptr_block(block));
+
+	return new_ptr;
+}
+
+// sum the statistics, busy locks are skipped with try set
+static void collect_stats(struct os_malloc_stats *stats, int try)
+{
+	size_t calls[2], bytes[2];
+
+	memset(stats, 0, sizeof(*stats));
+	for (int i = STAT_ALLOC; i <= STAT_FREE; i++) {
+		calls[i] = __atomic_load_n(&exited_stats.calls[i], __ATOMIC_RELAXED);
+		bytes[i] = __atomic_load_n(&exited_stats.bytes[i], __ATOMIC_RELAXED);
+	}
+	if (try ? pthread_mutex_trylock(&stats_lock) == 0 : pthread_mutex_lock(&stats_lock) == 0) {
+		for (struct thread_cache *cache = threads; cache; cache = cache->next) {
+			for (int i = STAT_ALLOC; i <= STAT_FREE; i++) {
+				calls[i] += __atomic_load_n(&cache->stats.calls[i], __ATOMIC_RELAXED);
+				bytes[i] += __atomic_load_n(&cache->stats.bytes[i], __ATOMIC_RELAXED);
+			}
+		}
+		pthread_mutex_unlock(&stats_lock);
+	}
+	stats->alloc_calls = calls[STAT_ALLOC];
+	stats->free_calls = calls[STAT_FREE];
+	// a thread may free what another one allocated, only the sum makes sense
+	stats->in_use = (bytes[STAT_ALLOC] > bytes[STAT_FREE]) ? bytes[STAT_ALLOC] - bytes[STAT_FREE] : 0;
+
+	if (try ? pthread_mutex_trylock(&mapped_lock) == 0 : pthread_mutex_lock(&mapped_lock) == 0) {
+		stats->mapped_blocks = mapped_count;
+		stats->mapped_in_use = mapped_usable;
+		stats->mapped_reserved = mapped_reserved + mmap_cache_bytes;
+		pthread_mutex_unlock(&mapped_lock);
+	}
+	if (stats->mapped_in_use > stats->in_use)
+		stats->mapped_in_use = stats->in_use;
+
+	stats->heap_reserved = __atomic_load_n(&arena_chunks, __ATOMIC_RELAXED) * ARENA_CHUNK_SIZE;
+	stats->slab_reserved = __atomic_load_n(&slab_segments, __ATOMIC_RELAXED) * SLAB_SEGMENT_SIZE;
+
+	for (int i = 0; i < MAX_ARENAS; i++) {
+		struct arena *arena = &arenas[i];
+
+		if (try ? pthread_mutex_trylock(&arena->lock) != 0 : pthread_mutex_lock(&arena->lock) != 0)
+			continue;
+		// the queued pointers count as free
+		if (!try)
+			drain_remote_frees(arena);
+		if (arena == main_arena)
+			stats->heap_reserved += heap_end - heap_start;
+		stats->free_bytes += arena->free_bytes;
+
+		// the largest block is in the last non empty bin
+		int index = -1;
+
+		for (int next = next_nonempty_bin(arena, 0); next >= 0; next = next_nonempty_bin(arena, next + 1))
+			index = next;
+		struct block_meta *largest = NULL;
+
+		if (index >= 0)
+			largest = (index < SMALL_BINS) ? arena->free_bins[index] : tree_largest(arena->free_bins[index]);
+		if (largest && block_size(largest) > stats->largest_free)
+			stats->largest_free = block_size(largest);
+		pthread_mutex_unlock(&arena->lock);
+	}
+
+	// the free bytes beyond the largest block can only serve smaller requests
+	if (stats->free_bytes > 0)
+		stats->fragmentation = 1.0 - (double) stats->largest_free / stats->free_bytes;
+}
+
+//----------------------------------------------------------------------//
+
+void *os_malloc(size_t size)
+{
+	if (size == 0 || size > MAX_REQUEST_SIZE)
+		return NULL;
+
+	config_init();
+	return debug_alloc(alloc_memory(size + DEBUG_TAIL_SIZE, __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED), 0),
+					   size);
+}
+
+void os_free(void *ptr)
+{
+	ptr = debug_free(ptr);
+	if (ptr != NULL && free_to_cache(ptr))
+		backend_free(ptr);
+}
+
+void os_free_sized(void *ptr, size_t size)
+{
+	if (ptr == NULL)
+		return;
+
+	// the size of a small pointer tells its slot size, the slab header isn't read
+	if (size > 0 && size <= SLAB_MAX_SIZE && pagemap_get(ptr) == PAGE_SLAB) {
+		stats_add(STAT_FREE, 1, slab_class_size[slab_class(size)]);
+		if (!tcache_put(ptr, slab_class_size[slab_class(size)]))
+			backend_free(ptr);
+		return;
+	}
+	os_free(ptr);
+}
+
+void os_free_batch(void **ptrs, size_t n)
+{
+	void *batch[FREE_BATCH];
+	size_t count = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		void *ptr = debug_free(ptrs[i]);
+
+		if (ptr == NULL || !free_to_cache(ptr))
+			continue;
+		batch[count++] = ptr;
+		if (count == FREE_BATCH) {
+			backend_free_batch(batch, count);
+			count = 0;
+		}
+	}
+	backend_free_batch(batch, count);
+}
+
+void *os_calloc(size_t nmemb, size_t size)
+{
+	size_t total;
+
+	if (__builtin_mul_overflow(nmemb, size, &total) || total == 0 || total > MAX_REQUEST_SIZE)
+		return NULL;
+
+	config_init();
+	// anything larger than a page comes zeroed from mmap
+	return debug_alloc(alloc_memory(total + DEBUG_TAIL_SIZE, getpagesize(), 1), total);
+}
+
+void *os_realloc(void *ptr, size_t size)
+{
+	if (ptr == NULL)
+		return os_malloc(size);
+
+	if (size == 0) {
+		os_free(ptr);
+		return NULL;
+	}
+	// ptr stays allocated, like on any failure
+	if (size > MAX_REQUEST_SIZE)
+		return NULL;
+
+	debug_check(ptr);
+	return debug_alloc(resize_memory(ptr, size + DEBUG_TAIL_SIZE), size);
+}
+
+size_t os_malloc_usable_size(void *ptr)
+{
+	if (ptr == NULL)
+		return 0;
+
+	if (pagemap_get(ptr) == PAGE_SLAB) {
+		struct slab *slab = slab_of(ptr);
+
+		return (slab_slot(slab, ptr) < 0) ? 0 : slab->slot_size;
+	}
+
+	struct block_meta *block = get_block_ptr(ptr);
+
+	if (!is_block_in_memory(block) ||
+		(block_status(block) != STATUS_ALLOC && block_status(block) != STATUS_MAPPED))
+		return 0;
+#ifdef OSMEM_DEBUG
+	// the bytes past the requested ones hold the tail canary
+	return block->requested;
+#else
+	return block_size(block);
+#endif
+}
+
+size_t os_good_size(size_t size)
+{
+	// tested before rounding, a request os_malloc refuses is returned as it is
+	if (size == 0 || size > MAX_REQUEST_SIZE)
+		return size;
+
+	config_init();
+	// the debug build asks alloc_memory for the tail too, the caller keeps what is left before it
+	size += DEBUG_TAIL_SIZE;
+	// the same choice as alloc_memory, the thread cache hands out blocks of these classes too
+	if (size <= SLAB_MAX_SIZE && !DEBUG_BUILD)
+		return slab_class_size[slab_class(size)];
+	if (ALIGN(size) + BLOCK_META_SIZE < __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED))
+		return heap_payload(size) - DEBUG_TAIL_SIZE;
+	return mapped_payload(size) - DEBUG_TAIL_SIZE;
+}
+
+void *os_memalign(size_t alignment, size_t size)
+{
+	if (size == 0)
+		return NULL;
+
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (size > MAX_REQUEST_SIZE)
+		return NULL;
+	return debug_alloc(alloc_aligned(alignment, size + DEBUG_TAIL_SIZE), size);
+}
+
+void *os_aligned_alloc(size_t alignment, size_t size)
+{
+	return os_memalign(alignment, size);
+}
+
+int os_posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment % sizeof(void *) != 0)
+		return EINVAL;
+
+	*memptr = NULL;
+	if (size == 0)
+		return 0;
+	if (size > MAX_REQUEST_SIZE)
+		return ENOMEM;
+	*memptr = debug_alloc(alloc_aligned(alignment, size + DEBUG_TAIL_SIZE), size);
+	return (*memptr) ? 0 : ENOMEM;
+}
+
+int os_mallopt(int param, int value)
+{
+	config_init();
+	return set_option(param, value);
+}
+
+void os_malloc_stats(struct os_malloc_stats *stats)
+{
+	collect_stats(stats, 0);
+}
+
+void os_malloc_stats_print(int fd)
+{
+	struct os_malloc_stats stats;
+	char buf[1024];
+
+	// in a signal handler, the interrupted code may hold any lock
+	collect_stats(&stats, 1);
+
+	unsigned long ratio = (unsigned long)(stats.fragmentation * 10000);
+	int len = snprintf(buf, sizeof(buf),
+					   "osmem: %zu allocs, %zu frees\n"
+					   "osmem: in use %zu bytes (heap %zu, mmap %zu in %zu blocks)\n"
+					   "osmem: reserved heap %zu, slabs %zu, mmap %zu bytes\n"
+					   "osmem: free %zu bytes, largest %zu, fragmentation %lu.%02lu%%\n",
+					   stats.alloc_calls, stats.free_calls,
+					   stats.in_use, stats.in_use - stats.mapped_in_use, stats.mapped_in_use, stats.mapped_blocks,
+					   stats.heap_reserved, stats.slab_reserved, stats.mapped_reserved,
+					   stats.free_bytes, stats.largest_free, ratio / 100, ratio % 100);
+
+	if (len > 0 && write(fd, buf, min(len, sizeof(buf) - 1)) < 0)
+		return;
+}
+
+void os_malloc_profile_dump(int fd)
+{
+	size_t live_count = 0, live_bytes = 0, total_count = 0, total_bytes = 0;
+	char buf[1024];
+	int len;
+
+	pthread_mutex_lock(&profile_lock);
+	for (size_t i = 0; profile_sites && i < PROFILE_SITES; i++) {
+		live_count += profile_sites[i].live_count;
+		live_bytes += profile_sites[i].live_bytes;
+		total_count += profile_sites[i].total_count;
+		total_bytes += profile_sites[i].total_bytes;
+	}
+
+	// the legacy heap profile of pprof, it scales the sampled counts back with the rate
+	len = snprintf(buf, sizeof(buf), "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%ld\n",
+				   live_count, live_bytes, total_count, total_bytes, profile_interval());
+	if (len > 0 && write(fd, buf, min(len, sizeof(buf) - 1)) < 0)
+		goto out;
+
+	for (size_t i = 0; profile_sites && i < PROFILE_SITES; i++) {
+		struct profile_site *site = &profile_sites[i];
+
+		if (site->depth == 0)
+			continue;
+		len = snprintf(buf, sizeof(buf), "%zu: %zu [%zu: %zu] @",
+					   site->live_count, site->live_bytes, site->total_count, site->total_bytes);
+		for (int j = 0; j < site->depth && len > 0 && (size_t) len < sizeof(buf); j++)
+			len += snprintf(buf + len, sizeof(buf) - len, " %p", site->stack[j]);
+		if (len > 0 && (size_t) len < sizeof(buf))
+			len += snprintf(buf + len, sizeof(buf) - len, "\n");
+		if (len > 0 && write(fd, buf, min(len, sizeof(buf) - 1)) < 0)
+			goto out;
+	}
+
+	// pprof symbolizes the addresses with the mappings of the process
+	int maps = open("/proc/self/maps", O_RDONLY);
+
+	if (maps >= 0) {
+		ssize_t count;
+
+		if (write(fd, "\nMAPPED_LIBRARIES:\n", 19) == 19)
+			while ((count = read(maps, buf, sizeof(buf))) > 0 && write(fd, buf, count) == count)
+				;
+		close(maps);
+	}
+out:
+	pthread_mutex_unlock(&profile_lock);
+}
+
+struct os_region *os_region_create(void)
+{
+	return os_calloc(1, sizeof(struct os_region));
+}
+
+void *os_region_alloc(struct os_region *region, size_t size)
+{
+	struct region_chunk *chunk;
+
+	if (region == NULL || size == 0 || size > MAX_REQUEST_SIZE)
+		return NULL;
+	size = ALIGN(size);
+
+	if (size <= (size_t)(region->end - region->next)) {
+		void *ptr = region->next;
+
+		region->next += size;
+		return ptr;
+	}
+
+	if (size > REGION_LARGE_SIZE) {
+		// the current chunk keeps serving the small allocations
+		chunk = os_malloc(REGION_CHUNK_HEADER_SIZE + size);
+		if (chunk == NULL)
+			return NULL;
+		chunk->size = size;
+		chunk->next = region->large;
+		region->large = chunk;
+		return (char *) chunk + REGION_CHUNK_HEADER_SIZE;
+	}
+
+	chunk = region->spare;
+	if (chunk) {
+		region->spare = chunk->next;
+	} else {
+		chunk = os_malloc(REGION_CHUNK_SIZE);
+		if (chunk == NULL)
+			return NULL;
+		chunk->size = REGION_CHUNK_SIZE - REGION_CHUNK_HEADER_SIZE;
+	}
+	chunk->next = region->chunks;
+	region->chunks = chunk;
+	if (region->last == NULL)
+		region->last = chunk;
+
+	region->next = (char *) chunk + REGION_CHUNK_HEADER_SIZE + size;
+	region->end = (char *) chunk + REGION_CHUNK_HEADER_SIZE + chunk->size;
+	return (char *) chunk + REGION_CHUNK_HEADER_SIZE;
+}
+
+void os_region_reset(struct os_region *region)
+{
+	if (region == NULL)
+		return;
+
+	// the chunks are kept for the next allocations, only the large ones are freed
+	while (region->large) {
+		struct region_chunk *chunk = region->large;
+
+		region->large = chunk->next;
+		os_free(chunk);
+	}
+	if (region->chunks) {
+		region->last->next = region->spare;
+		region->spare = region->chunks;
+	}
+	region->chunks = NULL;
+	region->last = NULL;
+	region->next = NULL;
+	region->end = NULL;
+}
+
+void os_region_destroy(struct os_region *region)
+{
+	if (region == NULL)
+		return;
+
+	os_region_reset(region);
+	while (region->spare) {
+		struct region_chunk *chunk = region->spare;
+
+		region->spare = chunk->next;
+		os_free(chunk);
+	}
+	os_free(region);
+}
+
+// OSMEM_STATS=1 dumps the statistics when the process exits
+__attribute__((destructor)) static void stats_at_exit(void)
+{
+	if (__atomic_load_n(&stats_at_exit_enabled, __ATOMIC_RELAXED))
+		os_malloc_stats_print(STDERR_FILENO);
+}
+
+// OSMEM_PROFILE_FILE=<path> writes the heap profile there when the process exits
+__attribute__((destructor)) static void profile_at_exit(void)
+{
+	const char *env = getenv("OSMEM_PROFILE_FILE");
+
+	if (env == NULL || profile_interval() == 0)
+		return;
+
+	int fd = open(env, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd >= 0) {
+		os_malloc_profile_dump(fd);
+		close(fd);
+	}
 }
@@ -9,5 +9,60 @@
 
 void *os_malloc(size_t size);
 void os_free(void *ptr);
+void os_free_sized(void *ptr, size_t size);
+void os_free_batch(void **ptrs, size_t n);
 void *os_calloc(size_t nmemb, size_t size);
 void *os_realloc(void *ptr, size_t size);
+void *os_memalign(size_t alignment, size_t size);
+void *os_aligned_alloc(size_t alignment, size_t size);
+int os_posix_memalign(void **memptr, size_t alignment, size_t size);
+
+/* Bytes the allocation of ptr can hold, at least the size it was asked with, 0 for an invalid pointer */
+size_t os_malloc_usable_size(void *ptr);
+/* Size of the class serving a request of size bytes, asking for that much wastes nothing */
+size_t os_good_size(size_t size);
+
+/* Allocator statistics, filled by os_malloc_stats, sizes are in bytes */
+struct os_malloc_stats {
+	size_t alloc_calls;
+	size_t free_calls;
+	size_t in_use; /* usable bytes of the live allocations, heap and mmap */
+	size_t mapped_in_use; /* part of in_use in mmap blocks */
+	size_t mapped_blocks;
+	size_t heap_reserved; /* sbrk heap and arena chunks */
+	size_t slab_reserved;
+	size_t mapped_reserved;
+	size_t free_bytes; /* in the free lists of the heaps */
+	size_t largest_free; /* largest FREE heap block */
+	double fragmentation; /* share of the free bytes outside the largest free block */
+};
+
+void os_malloc_stats(struct os_malloc_stats *stats);
+void os_malloc_stats_print(int fd);
+
+/*
+ * Tuning parameters for os_mallopt, it returns 1 on success and 0 if the value is rejected
+ * Most of them can also be set with OSMEM_* environment variables, read on the first allocation
+ */
+#define OS_M_ARENA_MAX 1 /* arenas the threads are spread over, before any heap allocation */
+#define OS_M_MMAP_THRESHOLD 2 /* requests of at least this many bytes are mapped, it no longer moves */
+#define OS_M_TRIM_THRESHOLD 3 /* FREE blocks at least this large give their pages back, it no longer moves */
+#define OS_M_PREALLOC 4 /* bytes of the first sbrk heap block, before any heap allocation */
+#define OS_M_GROW 5 /* bytes the sbrk heap grows by at least, also kept by a trim */
+#define OS_M_MMAP_CACHE 6 /* bytes of released mappings kept for reuse, 0 turns the cache off */
+#define OS_M_THP 7 /* huge page mode: 0 off, 1 madvise, 2 hugetlb */
+#define OS_M_PROFILE 8 /* mean bytes between heap profile samples, 0 turns it off, for threads yet to allocate */
+#define OS_M_STATS 9 /* 1 dumps the statistics on stderr at exit */
+
+int os_mallopt(int param, int value);
+
+/* Heap profile of the sampled allocations in the pprof legacy format, OSMEM_PROFILE=<bytes> turns it on */
+void os_malloc_profile_dump(int fd);
+
+/* Regions: allocations live until the region is reset or destroyed */
+struct os_region;
+
+struct os_region *os_region_create(void);
+void *os_region_alloc(struct os_region *region, size_t size);
+void os_region_reset(struct os_region *region);
+void os_region_destroy(struct os_region *region);
@@ -0,0 +1,139 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+// the C++ allocation operators on top of osmem, for libosmem-preload.so
+// sized deletes pass the size on, so small pointers are freed without reading their slab header
+
+#include <cstddef>
+#include <new>
+
+extern "C" {
+#include "osmem.h"
+}
+
+// allocate size bytes, calling the new handler until it succeeds, or throw bad_alloc
+static void *new_memory(std::size_t size, std::size_t alignment)
+{
+	for (;;) {
+		void *ptr = (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) ?
+					os_memalign(alignment, size ? size : 1) : os_malloc(size ? size : 1);
+
+		if (ptr != NULL)
+			return ptr;
+
+		std::new_handler handler = std::get_new_handler();
+
+		if (handler == NULL)
+			throw std::bad_alloc();
+		handler();
+	}
+}
+
+// the nothrow operators return NULL instead of throwing
+static void *new_memory_nothrow(std::size_t size, std::size_t alignment) noexcept
+{
+	try {
+		return new_memory(size, alignment);
+	} catch (...) {
+		return NULL;
+	}
+}
+
+void *operator new(std::size_t size)
+{
+	return new_memory(size, 0);
+}
+
+void *operator new[](std::size_t size)
+{
+	return new_memory(size, 0);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+	return new_memory_nothrow(size, 0);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+	return new_memory_nothrow(size, 0);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment)
+{
+	return new_memory(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment)
+{
+	return new_memory(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+	return new_memory_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+	return new_memory_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void *ptr) noexcept
+{
+	os_free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+	os_free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+	os_free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+	os_free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t size) noexcept
+{
+	os_free_sized(ptr, size);
+}
+
+void operator delete[](void *ptr, std::size_t size) noexcept
+{
+	os_free_sized(ptr, size);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept
+{
+	os_free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept
+{
+	os_free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+	os_free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+	os_free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t size, std::align_val_t) noexcept
+{
+	os_free_sized(ptr, size);
+}
+
+void operator delete[](void *ptr, std::size_t size, std::align_val_t) noexcept
+{
+	os_free_sized(ptr, size);
+}
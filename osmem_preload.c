@@ -0,0 +1,99 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+// the C allocation functions on top of osmem, for libosmem-preload.so:
+// LD_PRELOAD=./libosmem-preload.so serves every allocation of a program with osmem
+// they follow the C library where osmem differs: malloc(0) returns a unique pointer
+// and the failures set errno
+
+#include "osmem.h"
+#include <unistd.h>
+
+void *malloc(size_t size)
+{
+	void *ptr = os_malloc(size ? size : 1);
+
+	if (ptr == NULL)
+		errno = ENOMEM;
+	return ptr;
+}
+
+void free(void *ptr)
+{
+	os_free(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	void *ptr;
+
+	if (nmemb == 0 || size == 0)
+		nmemb = size = 1;
+	ptr = os_calloc(nmemb, size);
+	if (ptr == NULL)
+		errno = ENOMEM;
+	return ptr;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	void *new_ptr;
+
+	if (ptr == NULL)
+		return malloc(size);
+	// a zero size frees ptr and returns NULL, like the C library does
+	new_ptr = os_realloc(ptr, size);
+	if (new_ptr == NULL && size != 0)
+		errno = ENOMEM;
+	return new_ptr;
+}
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+	size_t total;
+
+	if (__builtin_mul_overflow(nmemb, size, &total)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return realloc(ptr, total);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	return os_posix_memalign(memptr, alignment, size ? size : 1);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	void *ptr;
+
+	// os_aligned_alloc rejects the alignments that are not a power of two with EINVAL
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+		return os_aligned_alloc(alignment, size ? size : 1);
+	ptr = os_aligned_alloc(alignment, size ? size : 1);
+	if (ptr == NULL)
+		errno = ENOMEM;
+	return ptr;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+	return aligned_alloc(alignment, size);
+}
+
+void *valloc(size_t size)
+{
+	return aligned_alloc(getpagesize(), size);
+}
+
+void *pvalloc(size_t size)
+{
+	size_t page_size = getpagesize();
+
+	return aligned_alloc(page_size, (size + page_size - 1) & ~(page_size - 1));
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+	return os_malloc_usable_size(ptr);
+}